@@ -1,6 +1,21 @@
 /* hashTable.c */
 
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
+#endif
 #include "hashTable.h"
+#if defined(HASHTABLE_INSTRUMENT) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+#if defined(__GLIBC__) && !defined(HASHTABLE_CUSTOM_ALLOC)
+#include <malloc.h>
+#define GLIBC_MALLOC
+#endif
 
 typedef uint8_t  u8;
 typedef int8_t   s8;
@@ -43,18 +58,58 @@ getNodeSize(u32 keyLen)
 	return (keyLen+1+sizeof(HtValue)+17+7)/8*8; // round up to 8 bytes
 }
 
+// blob tables keep a BlobHeader and the blob bytes after the key
+typedef struct BlobHeader {
+	u32 len;
+	u32 cap;
+} BlobHeader;
+
+#define BLOB_MAX (0xFFFF0000)
+
+static inline BlobHeader *
+nodeBlob(hashTableNode *node)
+{
+	return (BlobHeader*)((u8*)node+getNodeSize(node->keyLen));
+}
+
 static inline u32
-getMask(u32 size)
+blobCapFor(u32 blobLen)
+{
+	return (blobLen+7)/8*8;
+}
+
+// bytes allocated for a node, what a copy of it has to copy
+static inline u32
+nodeBytes(u32 flags, hashTableNode *node)
+{
+	u32 size = getNodeSize(node->keyLen);
+	if(flags & hashTable_flagBlobValues){
+		size += sizeof(BlobHeader)+nodeBlob(node)->cap;
+	}
+	return size;
+}
+
+static inline u64
+getMask(u64 size)
 {
 	return size-1;
 }
 
 static inline hashTableNode *
-makeNode(HashTable *ht, u8 *key, u32 keyLen, HtValue value, u64 hash)
+makeNode(
+	HashTable *ht,
+	u8        *key,
+	u32       keyLen,
+	HtValue   value,
+	u64       hash,
+	u32       blobCap)
 {
 	u32 i=0, nodeSize;
 	hashTableNode *new;
 	nodeSize = getNodeSize(keyLen);
+	if(ht->flags & hashTable_flagBlobValues){
+		nodeSize += sizeof(BlobHeader)+blobCap;
+	}
 	
 	new = HASHTABLE_MALLOC(nodeSize);
 	
@@ -66,6 +121,10 @@ makeNode(HashTable *ht, u8 *key, u32 keyLen, HtValue value, u64 hash)
 		new->keyLen = keyLen;
 		do{new->key[i]=key[i];i++;}while(i<keyLen);
 		new->key[keyLen] = 0; // null terminate
+		if(ht->flags & hashTable_flagBlobValues){
+			nodeBlob(new)->len = 0;
+			nodeBlob(new)->cap = blobCap;
+		}
 	}
 	return new;
 }
@@ -108,10 +167,544 @@ computeHash(u8 *key, u8 keyLen, u64 seed)
 	return hash;
 }
 
+#define ROTL(x,b) (u64)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+do{ \
+	v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+	v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+}while(0)
+
+// SipHash-1-3, public domain reference algorithm. The 128 bit key is derived
+// from the 64 bit table seed so hardened tables keep the same seed interface.
+static u64
+sipHash(u8 *key, u8 keyLen, u64 seed)
+{
+	u64 k0 = seed;
+	u64 k1 = ROTL(seed, 32) ^ 0x9e3779b97f4a7c15;
+	u64 v0 = k0 ^ 0x736f6d6570736575;
+	u64 v1 = k1 ^ 0x646f72616e646f6d;
+	u64 v2 = k0 ^ 0x6c7967656e657261;
+	u64 v3 = k1 ^ 0x7465646279746573;
+	u64 m, b = ((u64)keyLen) << 56;
+	u32 x = 0, left;
+
+	for(; x + 8 <= keyLen; x += 8){
+		m = (u64)key[x]         | (u64)key[x+1] <<  8 |
+		    (u64)key[x+2] << 16 | (u64)key[x+3] << 24 |
+		    (u64)key[x+4] << 32 | (u64)key[x+5] << 40 |
+		    (u64)key[x+6] << 48 | (u64)key[x+7] << 56;
+		v3 ^= m;
+		SIPROUND;
+		v0 ^= m;
+	}
+	left = keyLen - x;
+	while(left){
+		left--;
+		b |= ((u64)key[x+left]) << (8*left);
+	}
+	v3 ^= b;
+	SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static inline u64
+hashWith(u32 flags, u64 seed, u8 *key, u8 keyLen)
+{
+	if(flags & hashTable_flagHardened){
+		return sipHash(key, keyLen, seed);
+	}
+	return HT_HASH(key, keyLen, seed);
+}
+
+static inline u64
+hashKey(HashTable *ht, u8 *key, u8 keyLen)
+{
+	return hashWith(ht->flags, ht->seed, key, keyLen);
+}
+
+// seed for hardened tables, falls back to mixing time and address when the
+// kernel cannot provide random bytes
+static u64
+randomSeed(void *salt)
+{
+	u64 seed;
+	struct timespec ts;
+#ifdef __linux__
+	if(getrandom(&seed, sizeof(seed), 0) == sizeof(seed)){
+		return seed;
+	}
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	seed = (u64)ts.tv_nsec ^ ((u64)ts.tv_sec << 32) ^ (u64)(uintptr_t)salt;
+	// splitmix64 finalizer
+	seed ^= seed >> 30;
+	seed *= 0xbf58476d1ce4e5b9;
+	seed ^= seed >> 27;
+	seed *= 0x94d049bb133111eb;
+	seed ^= seed >> 31;
+	return seed;
+}
+
+/*******************************************************************************
+ * Section Bucket Array Allocation
+ * Plain tables use HASHTABLE_CALLOC. With the huge page or NUMA flags large
+ * arrays are mapped directly: hugetlb pages first (1GB then 2MB), otherwise
+ * normal pages with a transparent huge page hint. A NUMA policy is applied
+ * before the zero pages are first touched. Every step is best effort.
+*******************************************************************************/
+
+#define HUGE_2MB (2ull*1024*1024)
+#define HUGE_1GB (1024ull*1024*1024)
+
+#ifdef __linux__
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT (26)
+#endif
+#ifndef MPOL_BIND
+#define MPOL_BIND       (2)
+#define MPOL_INTERLEAVE (3)
+#endif
+
+static void *
+mapPages(u64 bytes, u64 pageSize, s32 extraFlags)
+{
+	void *mem = mmap(0, (bytes+pageSize-1)/pageSize*pageSize,
+		PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|extraFlags,
+		-1, 0);
+	return (mem == MAP_FAILED) ? 0 : mem;
+}
+
+// normal pages on a 2MB boundary, over map by 2MB and trim both ends so every
+// 2MB of the array can be backed by a transparent huge page
+static void *
+mapAligned2MB(u64 bytes)
+{
+	u8 *mem = mapPages(bytes+HUGE_2MB, sysconf(_SC_PAGESIZE), 0);
+	u8 *aligned;
+	if(mem == 0){
+		return 0;
+	}
+	aligned = (u8*)(((uintptr_t)mem+HUGE_2MB-1) & ~(uintptr_t)(HUGE_2MB-1));
+	if(aligned > mem){
+		munmap(mem, aligned-mem);
+	}
+	munmap(aligned+bytes, mem+HUGE_2MB-aligned);
+	return aligned;
+}
+
+static void
+applyNumaPolicy(u32 flags, u64 numaNodes, void *mem, u64 bytes)
+{
+	u64 nodes = numaNodes ? numaNodes : ~0ull;
+	s32 mode;
+	if(flags & hashTable_flagNumaBind){
+		mode = MPOL_BIND;
+	} else if(flags & hashTable_flagNumaInterleave){
+		mode = MPOL_INTERLEAVE;
+	} else {
+		return;
+	}
+	// mbind keeps the allowed nodes of the mask, failure leaves default policy,
+	// the kernel reads maxnode-1 bits so 65 covers all 64 nodes
+	syscall(SYS_mbind, mem, bytes, mode, &nodes, 65, 0);
+}
+
+// map bytes the way the huge page and NUMA flags ask, 0 when no flag is set
+// or every attempt fails, *mapped gets the bytes to unmap
+static void *
+mapForFlags(u32 flags, u64 numaNodes, u64 bytes, u64 *pageSize_p, u64 *mapped)
+{
+	u64 pageSize = HUGE_1GB;
+	void *mem = 0;
+	if( (flags & (hashTable_flagHugePages | hashTable_flagNumaInterleave
+		| hashTable_flagNumaBind)) == 0 ){
+		return 0;
+	}
+	if(flags & hashTable_flagHugePages){
+		if(bytes >= HUGE_1GB){
+			mem = mapPages(bytes, HUGE_1GB, MAP_HUGETLB|(30<<MAP_HUGE_SHIFT));
+		}
+		if(mem == 0){
+			pageSize = HUGE_2MB;
+			mem = mapPages(bytes, HUGE_2MB, MAP_HUGETLB|(21<<MAP_HUGE_SHIFT));
+		}
+	}
+	if(mem == 0){
+		// map whole aligned 2MB units so the kernel can use transparent
+		// huge pages
+		pageSize = sysconf(_SC_PAGESIZE);
+		bytes = (bytes+HUGE_2MB-1)/HUGE_2MB*HUGE_2MB;
+		mem = mapAligned2MB(bytes);
+		if(mem && (flags & hashTable_flagHugePages)){
+			madvise(mem, bytes, MADV_HUGEPAGE);
+		}
+	}
+	if(mem){
+		bytes = (bytes+pageSize-1)/pageSize*pageSize;
+		applyNumaPolicy(flags, numaNodes, mem, bytes);
+		*pageSize_p = pageSize;
+		*mapped = bytes;
+	}
+	return mem;
+}
+#endif
+
+static hashTableNode **
+allocTable(HashTable *ht, u64 entries)
+{
+	u64 bytes = entries*ENTRY_SIZE;
+	ht->tablePageSize = 0;
+	ht->tableMapped = 0;
+#ifdef __linux__
+	if(bytes >= HASHTABLE_MAP_MIN){
+		u64 pageSize, mapped;
+		void *mem = mapForFlags(ht->flags, ht->numaNodes, bytes, &pageSize,
+			&mapped);
+		if(mem){
+			ht->tablePageSize = pageSize;
+			ht->tableMapped = mapped;
+			return mem;
+		}
+	}
+#endif
+	return HASHTABLE_CALLOC(1, bytes);
+}
+
+static void
+freeTable(hashTableNode **table, u64 mapped)
+{
+#ifdef __linux__
+	if(mapped){
+		munmap(table, mapped);
+		return;
+	}
+#endif
+	(void)mapped;
+	HASHTABLE_FREE(table);
+}
+
+/*******************************************************************************
+ * Section Node Slabs
+ * Nodes moved by hashTable_compact live in slabs. The registry is sorted by
+ * base address so a free can tell slab nodes from heap nodes. Slabs are only
+ * appended to, the space of freed nodes comes back when a slab empties.
+*******************************************************************************/
+
+#define SLAB_SIZE (2*1024*1024)
+// larger nodes stay in the heap
+#define SLAB_NODE_MAX (SLAB_SIZE/8)
+
+typedef struct Slab {
+	u8  *base;
+	u32 used;    // bytes handed out
+	u32 live;    // bytes of nodes not freed yet
+} Slab;
+
+struct HashTableSlabs {
+	Slab *slabs;
+	u64  cursor;   // next bucket to compact
+	u64  numaNodes; // node mask of the table for the NUMA flags
+	u32  count;
+	u32  cap;
+	u32  fill;     // slab being appended to, count when there is none
+	u32  flags;    // flags of the table, for nodeBytes and slabMap
+	u32  changes;  // resizes and reseeds of the table when the pass began
+};
+
+// the table's huge page and NUMA flags apply to slabs as to its bucket array
+static u8 *
+slabMap(HashTableSlabs *slabs)
+{
+#ifdef __linux__
+	u64 pageSize, mapped;
+	u8 *base = mapForFlags(slabs->flags, slabs->numaNodes, SLAB_SIZE,
+		&pageSize, &mapped);
+	return base ? base : mapPages(SLAB_SIZE, SLAB_SIZE, 0);
+#else
+	return HASHTABLE_MALLOC(SLAB_SIZE);
+#endif
+}
+
+static void
+slabUnmap(u8 *base)
+{
+#ifdef __linux__
+	munmap(base, SLAB_SIZE);
+#else
+	HASHTABLE_FREE(base);
+#endif
+}
+
+// index of the first slab with a base above ptr
+static u32
+slabUpper(HashTableSlabs *slabs, void *ptr)
+{
+	u32 low = 0, high = slabs->count, mid;
+	while(low < high){
+		mid = (low+high)/2;
+		if((u8*)ptr < slabs->slabs[mid].base){
+			high = mid;
+		} else {
+			low = mid+1;
+		}
+	}
+	return low;
+}
+
+// index of the slab holding ptr, slabs->count if ptr is not in one
+static u32
+slabFind(HashTableSlabs *slabs, void *ptr)
+{
+	u32 index = slabUpper(slabs, ptr);
+	if( (index > 0) && ((u8*)ptr < slabs->slabs[index-1].base+SLAB_SIZE) ){
+		return index-1;
+	}
+	return slabs->count;
+}
+
+static void
+slabRemove(HashTableSlabs *slabs, u32 index)
+{
+	u32 x;
+	slabUnmap(slabs->slabs[index].base);
+	for(x = index; x+1 < slabs->count; x++){
+		slabs->slabs[x] = slabs->slabs[x+1];
+	}
+	slabs->count--;
+	if(slabs->fill > index){
+		slabs->fill--;
+	}
+}
+
+static void *
+slabAlloc(HashTableSlabs *slabs, u32 bytes)
+{
+	Slab *slab, *grown;
+	u32 x, index, old = slabs->fill;
+	u8 *base;
+	if( (old == slabs->count) || (slabs->slabs[old].used+bytes > SLAB_SIZE) ){
+		if(slabs->count == slabs->cap){
+			grown = HASHTABLE_REALLOC(slabs->slabs,
+				(slabs->cap ? slabs->cap*2 : 16)*sizeof(Slab));
+			if(grown==0){
+				return 0;
+			}
+			slabs->slabs = grown;
+			slabs->cap = slabs->cap ? slabs->cap*2 : 16;
+		}
+		base = slabMap(slabs);
+		if(base==0){
+			return 0;
+		}
+		slabs->fill = slabs->count;
+		if( (old < slabs->count) && (slabs->slabs[old].live == 0) ){
+			slabRemove(slabs, old);
+		}
+		index = slabUpper(slabs, base);
+		for(x = slabs->count; x > index; x--){
+			slabs->slabs[x] = slabs->slabs[x-1];
+		}
+		slabs->slabs[index].base = base;
+		slabs->slabs[index].used = 0;
+		slabs->slabs[index].live = 0;
+		slabs->count++;
+		slabs->fill = index;
+	}
+	slab = &slabs->slabs[slabs->fill];
+	base = slab->base+slab->used;
+	slab->used += bytes;
+	slab->live += bytes;
+	return base;
+}
+
+static void
+slabsFree(HashTableSlabs *slabs)
+{
+	u32 x;
+	if(slabs==0){
+		return;
+	}
+	for(x = 0; x < slabs->count; x++){
+		slabUnmap(slabs->slabs[x].base);
+	}
+	HASHTABLE_FREE(slabs->slabs);
+	HASHTABLE_FREE(slabs);
+}
+
+// every node free goes through here, slabs may be 0
+static void
+freeNode(HashTableSlabs *slabs, hashTableNode *node)
+{
+	u32 index;
+	if(slabs && slabs->count){
+		index = slabFind(slabs, node);
+		if(index < slabs->count){
+			slabs->slabs[index].live -= nodeBytes(slabs->flags, node);
+			if( (slabs->slabs[index].live == 0) && (index != slabs->fill) ){
+				slabRemove(slabs, index);
+			}
+			return;
+		}
+	}
+	HASHTABLE_FREE(node);
+}
+
+// realloc for nodes, a slab node is copied out to the heap
+static hashTableNode *
+growNode(HashTable *ht, hashTableNode *node, u64 bytes)
+{
+	hashTableNode *grown;
+	u32 x, oldBytes;
+	if( (ht->slabs==0) || (slabFind(ht->slabs, node) == ht->slabs->count) ){
+		return HASHTABLE_REALLOC(node, bytes);
+	}
+	oldBytes = nodeBytes(ht->flags, node);
+	grown = HASHTABLE_MALLOC(bytes);
+	if(grown){
+		for(x = 0; x < oldBytes; x++){
+			((u8*)grown)[x] = ((u8*)node)[x];
+		}
+		freeNode(ht->slabs, node);
+	}
+	return grown;
+}
+
+/*******************************************************************************
+ * Section Snapshot Internals
+ * Only the thread that mutates the table writes segments[]. A reader that finds
+ * a segment still in the live table walks it holding the segment lock, and the
+ * writer takes that lock to publish a copy before changing the segment.
+*******************************************************************************/
+
+#define SEGMENT_SIZE (HASHTABLE_SNAPSHOT_SEGMENT)
+
+// shared by segments whose buckets were all empty, never freed
+static hashTableNode *emptySegment[SEGMENT_SIZE];
+
+static inline u64
+segmentCount(u64 size)
+{
+	return (size+SEGMENT_SIZE-1)/SEGMENT_SIZE;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() do{}while(0)
+#endif
+
+static inline void
+snapshotLock(HashTableSnapshot *snap, u64 segment)
+{
+	while(__atomic_test_and_set(&snap->locks[segment], __ATOMIC_ACQUIRE)){
+		CPU_RELAX();
+	}
+}
+
+static inline void
+snapshotUnlock(HashTableSnapshot *snap, u64 segment)
+{
+	__atomic_clear(&snap->locks[segment], __ATOMIC_RELEASE);
+}
+
+static void
+freeChain(HashTableSlabs *slabs, hashTableNode *curNode)
+{
+	hashTableNode *prevNode;
+	while(curNode){
+		prevNode = curNode;
+		curNode = curNode->next;
+		freeNode(slabs, prevNode);
+	}
+}
+
+static void
+freeSegment(hashTableNode **heads, u32 buckets)
+{
+	u32 x;
+	if(heads == emptySegment){
+		return;
+	}
+	for(x = 0; x < buckets; x++){
+		freeChain(0, heads[x]);
+	}
+	HASHTABLE_FREE(heads);
+}
+
+static inline u32
+segmentBuckets(HashTableSnapshot *snap, u64 segment)
+{
+	u64 first = segment*SEGMENT_SIZE;
+	return (snap->size-first < SEGMENT_SIZE) ? snap->size-first : SEGMENT_SIZE;
+}
+
+// copy one segment of the live table in to the snapshot
+static s32
+preserveSegment(HashTableSnapshot *snap, u64 segment)
+{
+	hashTableNode **heads, **tail, *curNode, *copy;
+	u64 first = segment*SEGMENT_SIZE;
+	u32 buckets = segmentBuckets(snap, segment);
+	u32 x, y, allEmpty = 1;
+	for(x = 0; x < buckets; x++){
+		if(snap->table[first+x]){
+			allEmpty = 0;
+		}
+	}
+	if(allEmpty){
+		heads = emptySegment;
+	} else {
+		heads = HASHTABLE_CALLOC(SEGMENT_SIZE, ENTRY_SIZE);
+		if(heads==0){
+			return hashTable_errorMallocFailed;
+		}
+		for(x = 0; x < buckets; x++){
+			tail = &heads[x];
+			for(curNode = snap->table[first+x]; curNode; curNode = curNode->next){
+				copy = HASHTABLE_MALLOC(nodeBytes(snap->flags, curNode));
+				if(copy==0){
+					freeSegment(heads, buckets);
+					return hashTable_errorMallocFailed;
+				}
+				for(y = 0; y < nodeBytes(snap->flags, curNode); y++){
+					((u8*)copy)[y] = ((u8*)curNode)[y];
+				}
+				copy->next = 0;
+				*tail = copy;
+				tail = &copy->next;
+			}
+		}
+	}
+	snapshotLock(snap, segment);
+	__atomic_store_n(&snap->segments[segment], heads, __ATOMIC_RELEASE);
+	snapshotUnlock(snap, segment);
+	return hashTable_OK;
+}
+
+// called before the live table changes bucket
+static inline s32
+snapshotPrepare(HashTable *ht, u64 bucket)
+{
+	HashTableSnapshot *snap = ht->snapshot;
+	u64 segment = bucket/SEGMENT_SIZE;
+	if(snap->segments[segment]){
+		return hashTable_OK;
+	}
+	return preserveSegment(snap, segment);
+}
+
 static void
 insert_node(
 	hashTableNode *n,
-	u32 mask,
+	u64 mask,
 	hashTableNode **table)
 {
 	u64 hash;
@@ -123,11 +716,11 @@ insert_node(
 }
 
 static void
-insertInToNewTable(HashTable *ht, u32 size, u32 mask, hashTableNode **oldTable)
+insertInToNewTable(HashTable *ht, u64 size, u64 mask, hashTableNode **oldTable)
 {
 	hashTableNode *curNode, *nextNode;
 	hashTableNode **table = ht->table;
-	u32 x = 0;
+	u64 x = 0;
 	do {
 		curNode = oldTable[x];
 		while(curNode){
@@ -141,34 +734,46 @@ insertInToNewTable(HashTable *ht, u32 size, u32 mask, hashTableNode **oldTable)
 }
 
 static s32
-newTableAndPopulate(HashTable *ht, u32 oldSize, u64 newSize)
+newTableAndPopulate(HashTable *ht, u64 oldSize, u64 newSize)
 {
 	hashTableNode **oldTable;
-	u32 mask;
+	u64 oldMapped, mask;
+	u32 oldPageSize;
+	if(ht->snapshot){
+		// relinking every node would mean copying the whole table in to the
+		// snapshot, chains grow instead until hashTable_releaseSnapshot
+		return hashTable_OK;
+	}
 	// save off old table
 	oldTable = ht->table;
+	oldMapped = ht->tableMapped;
+	oldPageSize = ht->tablePageSize;
 	// make new table
-	ht->table = HASHTABLE_CALLOC(1, newSize*ENTRY_SIZE);
+	ht->table = allocTable(ht, newSize);
 	
 	if (ht->table==0)
 	{
 		// set table back to old one and report error
 		ht->table = oldTable;
+		ht->tableMapped = oldMapped;
+		ht->tablePageSize = oldPageSize;
 		return hashTable_errorCannotMakeNewTable;
 	}
 	
 	// put everything into new table
 	mask = getMask(newSize);
 	insertInToNewTable(ht, oldSize, mask, oldTable);
+	ht->size = newSize;
+	ht->resizes++;
 	// free old tree
-	HASHTABLE_FREE(oldTable);
+	freeTable(oldTable, oldMapped);
 	return hashTable_OK;
 }
 
 static s32
 checkSizeToGrow(HashTable *ht)
 {
-	u32 oldSize;
+	u64 oldSize;
 	u64 newSize;
 	oldSize = ht->size;
 	// check if we need to re-size hashtable
@@ -176,9 +781,12 @@ checkSizeToGrow(HashTable *ht)
 	{
 		return hashTable_OK;
 	}
-	// resize to double, new table will be half full
+	// resize to double, new table will be half full, more after a resize was
+	// deferred by a snapshot
 	newSize = oldSize*2;
-	ht->size = newSize;
+	while( (ht->count+1) > newSize ){
+		newSize *= 2;
+	}
 	
 	return newTableAndPopulate(ht, oldSize, newSize);
 }
@@ -186,7 +794,7 @@ checkSizeToGrow(HashTable *ht)
 static s32
 checkSizeToShrink(HashTable *ht)
 {
-	u32 oldSize;
+	u64 oldSize;
 	u64 newSize;
 	oldSize = ht->size;
 	// check for minimum hash table size
@@ -199,13 +807,72 @@ checkSizeToShrink(HashTable *ht)
 	{
 		return hashTable_OK;
 	}
-	// resize to half, new table will be half full
+	// resize to half, new table will be half full, less after a resize was
+	// deferred by a snapshot
 	newSize = oldSize/2;
-	ht->size = newSize;
+	while( (newSize > 8) && ((ht->count-1) < (newSize/4)) ){
+		newSize /= 2;
+	}
 	
 	return newTableAndPopulate(ht, oldSize, newSize);
 }
 
+// Pick a new seed and rehash every node in place. Used by hardened tables when
+// a chain grows too long, no memory is allocated so this cannot fail.
+static void
+reseedTable(HashTable *ht)
+{
+	hashTableNode **table = ht->table;
+	hashTableNode *list = 0, *curNode, *nextNode;
+	u64 size = ht->size, mask = getMask(ht->size), x;
+	if(ht->snapshot){
+		// hashTable_releaseSnapshot reseeds
+		ht->reseedPending = 1;
+		return;
+	}
+	ht->reseedPending = 0;
+	// unlink every node into a single list
+	for(x = 0; x < size; x++)
+	{
+		curNode = table[x];
+		table[x] = 0;
+		while(curNode){
+			nextNode = curNode->next;
+			curNode->next = list;
+			list = curNode;
+			curNode = nextNode;
+		}
+	}
+	ht->seed = randomSeed(ht);
+	ht->reseeds++;
+	while(list){
+		nextNode = list->next;
+		list->hash = hashKey(ht, list->key, list->keyLen);
+		insert_node(list, mask, table);
+		list = nextNode;
+	}
+}
+
+// run the resize and reseed deferred while a snapshot was attached, if memory
+// runs out the next insert or delete tries the resize again
+static void
+snapshotCatchUp(HashTable *ht)
+{
+	u64 newSize = ht->size;
+	while(ht->count > newSize){
+		newSize *= 2;
+	}
+	while( (newSize > 8) && (ht->count < newSize/4) ){
+		newSize /= 2;
+	}
+	if(newSize != ht->size){
+		newTableAndPopulate(ht, ht->size, newSize);
+	}
+	if(ht->reseedPending){
+		reseedTable(ht);
+	}
+}
+
 /*******************************************************************************
  * Section Init
 *******************************************************************************/
@@ -213,6 +880,13 @@ checkSizeToShrink(HashTable *ht)
 HASHTABLE_STATIC_BUILD
 s32
 hashTable_init(HashTable **ht_p)
+{
+	return hashTable_initWithFlags(ht_p, 0);
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_initWithFlags(HashTable **ht_p, u32 flags)
 {
 	HashTable *ht;
 	if(ht_p==0){
@@ -224,35 +898,211 @@ hashTable_init(HashTable **ht_p)
 	}
 	ht->table = HASHTABLE_CALLOC(1, BASE_SIZE);
 	if(ht->table==0){
+		HASHTABLE_FREE(ht);
 		return hashTable_errorMallocFailed;
 	}
 	ht->seed =  0xcbf29ce484222325;
 	ht->count = 0;
 	ht->size  = BASE_SIZE/ENTRY_SIZE;
+	ht->snapshot = 0;
+	ht->hook = 0;
+	ht->hookCtx = 0;
+	ht->tablePageSize = 0;
+	ht->tableMapped = 0;
+	ht->numaNodes = 0;
+	ht->slabs = 0;
+	ht->flags = flags;
+	ht->resizes = 0;
+	ht->reseeds = 0;
+	ht->reseedPending = 0;
+	ht->instrument = 0;
+#ifdef HASHTABLE_INSTRUMENT
+	ht->instrument = HASHTABLE_CALLOC(1, sizeof(HashTableInstrument));
+	if(ht->instrument==0){
+		HASHTABLE_FREE(ht->table);
+		HASHTABLE_FREE(ht);
+		return hashTable_errorMallocFailed;
+	}
+	ht->instrument->countdown = HASHTABLE_INSTRUMENT;
+#endif
+	if(flags & hashTable_flagHardened){
+		ht->seed = randomSeed(ht);
+	}
 	*ht_p = ht;
 	return hashTable_OK;
 }
 
 /*******************************************************************************
- * Section Insertion
- ******************************************************************************/
+ * Section Sampling
+ * SAMPLE_START opens a sample in an operation, SAMPLE_STEP counts a node
+ * walked and SAMPLE_END records it. Without HASHTABLE_INSTRUMENT all three
+ * expand to nothing.
+*******************************************************************************/
 
-static s32
-HashTable_insert_internal(
+#ifdef HASHTABLE_INSTRUMENT
+
+static inline u64
+readTicks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (u64)now.tv_sec*1000000000 + now.tv_nsec;
+#endif
+}
+
+// 0 when this call is not sampled, rdtsc does not return 0 in practice
+static inline u64
+sampleBegin(HashTable *ht)
+{
+	HashTableInstrument *inst = ht->instrument;
+	if(__builtin_expect(--inst->countdown != 0, 1)){
+		return 0;
+	}
+	inst->countdown = HASHTABLE_INSTRUMENT;
+	return readTicks() | 1;
+}
+
+static void
+sampleRecord(
 	HashTable *ht,
-	u8        *key,
-	u8         keyLen,
-	HtValue    value)
+	u64       start,
+	u8        op,
+	u8        hit,
+	u32       chain,
+	u32       changes)
+{
+	HashTableInstrument *inst = ht->instrument;
+	HashTableOpHistogram *hist = &inst->ops[op];
+	HashTableSample *sample;
+	u64 ticks = readTicks() - start;
+	u32 bucket = ticks ? 64 - __builtin_clzll(ticks) : 0;
+	u8 resized = (ht->resizes + ht->reseeds) != changes;
+	if(bucket >= HASHTABLE_HIST_BUCKETS){
+		bucket = HASHTABLE_HIST_BUCKETS-1;
+	}
+	hist->samples++;
+	hist->hits += hit;
+	hist->resized += resized;
+	hist->chainTotal += chain;
+	if(ticks > hist->maxTicks){
+		hist->maxTicks = ticks;
+	}
+	hist->ticks[bucket]++;
+	if(!hit){
+		hist->missTicks[bucket]++;
+	}
+	sample = &inst->recent[inst->recorded++ % HASHTABLE_SAMPLE_RING];
+	sample->ticks = ticks;
+	sample->chain = chain;
+	sample->op = op;
+	sample->hit = hit;
+	sample->resized = resized;
+	sample->pad = 0;
+}
+
+#define SAMPLE_START(ht) \
+	u64 sampleStart = sampleBegin(ht); \
+	u32 sampleChain = 0; \
+	u32 sampleChanges = (ht)->resizes + (ht)->reseeds
+#define SAMPLE_STEP() (sampleChain++)
+#define SAMPLE_END(ht, op, hit) \
+	do{ if(__builtin_expect(sampleStart != 0, 0)){ \
+		sampleRecord((ht), sampleStart, (op), (hit), sampleChain, \
+			sampleChanges); } }while(0)
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_getInstrument(HashTable *ht, HashTableInstrument *out)
+{
+	if(ht==0){
+		return hashTable_errorNullParam1;
+	}
+	if(out==0){
+		return hashTable_errorNullParam2;
+	}
+	*out = *ht->instrument;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_resetInstrument(HashTable *ht)
+{
+	u32 countdown;
+	if(ht==0){
+		return hashTable_errorNullParam1;
+	}
+	countdown = ht->instrument->countdown;
+	*ht->instrument = (HashTableInstrument){0};
+	ht->instrument->countdown = countdown;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+u64
+hashTable_histogramQuantile(HashTableOpHistogram *hist, double q)
+{
+	u64 want, seen = 0;
+	u32 x;
+	if( (hist==0) || (hist->samples==0) ){
+		return 0;
+	}
+	want = (u64)(q*hist->samples);
+	if(want >= hist->samples){
+		return hist->maxTicks;
+	}
+	for(x = 0; x < HASHTABLE_HIST_BUCKETS; x++){
+		seen += hist->ticks[x];
+		if(seen > want){
+			break;
+		}
+	}
+	if(x == 0){
+		return 0;
+	}
+	// the last bucket also holds everything larger
+	if( (x >= HASHTABLE_HIST_BUCKETS-1) || (((u64)1<<x) > hist->maxTicks) ){
+		return hist->maxTicks;
+	}
+	return (u64)1<<x;
+}
+
+#else
+
+#define SAMPLE_START(ht)
+#define SAMPLE_STEP()
+#define SAMPLE_END(ht, op, hit)
+
+#endif
+
+/*******************************************************************************
+ * Section Insertion
+ ******************************************************************************/
+
+static s32
+HashTable_insert_internal(
+	HashTable *ht,
+	u8        *key,
+	u8         keyLen,
+	HtValue    value)
 {
 	u64 hash, maskedHash;
 	hashTableNode *newNode, *curNode, **nodeAddr;
 	s32 returnCode;
+	u32 chain = 0;
+	SAMPLE_START(ht);
 	
 	returnCode = checkSizeToGrow(ht);
 	
-	hash = HT_HASH(key, keyLen, ht->seed);
+	hash = hashKey(ht, key, keyLen);
 	// search for existing key
 	maskedHash = hash & getMask(ht->size);
+	if( ht->snapshot && snapshotPrepare(ht, maskedHash) ){
+		return hashTable_errorMallocFailed;
+	}
 	nodeAddr = &ht->table[maskedHash];
 
 	// begin search for slot
@@ -261,11 +1111,21 @@ HashTable_insert_internal(
 		if (curNode == 0)
 		{
 			// nothing exists, make node and insert
-			newNode = makeNode(ht, key, keyLen, value, hash);
+			newNode = makeNode(ht, key, keyLen, value, hash, 0);
 			if (newNode==0) {
 				return hashTable_errorMallocFailed;
 			}
 			*nodeAddr = newNode;
+			if(ht->hook){
+				ht->hook(ht->hookCtx, hashTable_opInsert, newNode->key, keyLen,
+					value);
+			}
+			// FNV collisions do not depend on the seed, only reseed keyed hashes
+			if( (chain >= HASHTABLE_MAX_CHAIN)
+				&& (ht->flags & hashTable_flagHardened) ){
+				reseedTable(ht);
+			}
+			SAMPLE_END(ht, hashTable_sampleInsert, 0);
 			return returnCode;
 		}
 		if (keyCmp(
@@ -277,21 +1137,1750 @@ HashTable_insert_internal(
 				curNode->hash)==0 ) {
 			// key does exist, update value
 			curNode->value = value;
+			if(ht->hook){
+				ht->hook(ht->hookCtx, hashTable_opInsert, curNode->key, keyLen,
+					value);
+			}
+			SAMPLE_END(ht, hashTable_sampleInsert, 1);
 			return hashTable_updatedValOfExistingKey;
 		}
-		nodeAddr = &curNode->next;
+		nodeAddr = &curNode->next;
+		chain++;
+		SAMPLE_STEP();
+	}
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_insert(
+	HashTable *ht,
+	u8        *key,
+	u8        keyLen,
+	HtValue   value)
+{
+	if(ht==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	return HashTable_insert_internal(ht, key, keyLen, value);
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_insertIntKey(
+	HashTable *ht,
+	s64       key,
+	HtValue   value)
+{
+	u8 keyBuffer[16];
+	u8 keyLen;
+	if(ht==0){
+		return hashTable_errorNullParam1;
+	}
+	keyLen = hashTable_s64toString(key, keyBuffer);
+	return HashTable_insert_internal(ht, keyBuffer, keyLen, value);
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_update(
+	HashTable *ht,
+	u8        *key,
+	u8        keyLen,
+	HtValue   value)
+{
+	u64 hash, maskedHash;
+	hashTableNode *curNode;
+	if(ht==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	SAMPLE_START(ht);
+	
+	hash = hashKey(ht, key, keyLen);
+	maskedHash = hash & getMask(ht->size);
+	curNode = ht->table[maskedHash];
+	while( curNode && keyCmp(key, keyLen, hash, curNode->key, curNode->keyLen,
+		curNode->hash) ){
+		curNode = curNode->next;
+		SAMPLE_STEP();
+	}
+	if(curNode==0){
+		SAMPLE_END(ht, hashTable_sampleInsert, 0);
+		return hashTable_nothingFound;
+	}
+	// the snapshot copies the segment, the live node stays where it is
+	if( ht->snapshot && snapshotPrepare(ht, maskedHash) ){
+		return hashTable_errorMallocFailed;
+	}
+	curNode->value = value;
+	if(ht->hook){
+		ht->hook(ht->hookCtx, hashTable_opInsert, curNode->key, keyLen, value);
+	}
+	SAMPLE_END(ht, hashTable_sampleInsert, 1);
+	return hashTable_updatedValOfExistingKey;
+}
+
+/*******************************************************************************
+ * Section Find
+*******************************************************************************/
+
+static hashTableNode *
+hashTable_find_internal(
+	HashTable *ht,
+	u8        *key,
+	u8        keyLen)
+{
+	u64 hash, maskedHash;
+	hashTableNode *curNode;
+	SAMPLE_START(ht);
+	
+	hash = hashKey(ht, key, keyLen);
+	// search for existing key
+	maskedHash = hash & getMask(ht->size);
+	curNode = ht->table[maskedHash];
+	
+	// something exists,  might be key
+	while (1) {
+		if (curNode == 0)
+		{
+			// nothing exists
+			SAMPLE_END(ht, hashTable_sampleFind, 0);
+			return 0;
+		}
+		if(keyCmp(
+			key,
+			keyLen,
+			hash,
+			curNode->key,
+			curNode->keyLen,
+			curNode->hash)==0){
+			// key does exist, return key
+			SAMPLE_END(ht, hashTable_sampleFind, 1);
+			return curNode;
+		}
+		curNode=curNode->next;
+		SAMPLE_STEP();
+	}
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_find(
+	HashTable      *ht,
+	u8             *key,
+	u8              keyLen,
+	hashTableNode **result)
+{
+	hashTableNode *internalResult;
+	if(ht==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	if(result==0){
+		return hashTable_errorNullParam4;
+	}
+	
+	internalResult = hashTable_find_internal(ht, key, keyLen);
+	if(ht->hook){
+		ht->hook(ht->hookCtx,
+			internalResult ? hashTable_opFind : hashTable_opFindMiss,
+			key, keyLen, internalResult ? internalResult->value : 0);
+	}
+	if(internalResult==0){
+		return hashTable_nothingFound;
+	}
+	
+	*result = internalResult;
+	return hashTable_OK;
+}
+
+
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_findIntKey(
+	HashTable     *ht,
+	s64           key,
+	hashTableNode **result)
+{
+	u8 keyBuffer[16];
+	u8 keyLen = hashTable_s64toString(key, keyBuffer);
+	return hashTable_find(ht, keyBuffer, keyLen, result);
+}
+
+/*******************************************************************************
+ * Section Deletion
+*******************************************************************************/
+
+static s32
+hashTable_delete_internal(
+	HashTable *ht,
+	u8        *key,
+	u8        keyLen,
+	HtValue   *value)
+{
+	u64 hash, maskedHash;
+	hashTableNode **curSlotAddr, *node;
+	s32 returnCode;
+	SAMPLE_START(ht);
+	
+	returnCode = checkSizeToShrink(ht);
+	
+	hash = hashKey(ht, key, keyLen);
+	// search for existing key
+	maskedHash = hash & getMask(ht->size);
+	if( ht->snapshot && snapshotPrepare(ht, maskedHash) ){
+		return hashTable_errorMallocFailed;
+	}
+	curSlotAddr = &ht->table[maskedHash];
+	
+	// something exists,  might be key
+	while (1){
+		node = *curSlotAddr;
+		if (node == 0)
+		{
+			// nothing exists
+			SAMPLE_END(ht, hashTable_sampleDelete, 0);
+			return hashTable_nothingFound;
+		}
+		if(keyCmp(
+			key,
+			keyLen,
+			hash,
+			node->key,
+			node->keyLen,
+			node->hash)==0){
+			// key does exist, delete key
+			// if passed a pointer write out value
+			if(value){
+				*value = node->value;
+			}
+			// over write memory with next address
+			*curSlotAddr = node->next;
+			if(ht->hook){
+				ht->hook(ht->hookCtx, hashTable_opDelete, key, keyLen, node->value);
+			}
+
+			freeNode(ht->slabs, node);
+			ht->count--;
+			SAMPLE_END(ht, hashTable_sampleDelete, 1);
+			return returnCode;
+		}
+		curSlotAddr = &node->next;
+		SAMPLE_STEP();
+	}
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_delete(
+	HashTable *ht,
+	u8        *key,
+	u8        keyLen,
+	HtValue   *value)
+{	
+	if(ht==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	return hashTable_delete_internal(ht, key, keyLen, value);
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_deleteIntKey(
+	HashTable *ht,
+	s64       key,
+	HtValue   *value)
+{
+	u8 keyBuffer[16];
+	u8 keyLen;
+	if(ht==0){
+		return hashTable_errorNullParam1;
+	}
+	keyLen = hashTable_s64toString(key, keyBuffer);
+	return hashTable_delete_internal(ht, keyBuffer, keyLen, value);
+}
+
+/*******************************************************************************
+ * Section Blob Values
+*******************************************************************************/
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_insertBlob(
+	HashTable  *ht,
+	u8         *key,
+	u8         keyLen,
+	const void *blob,
+	u32        blobLen)
+{
+	u64 hash, maskedHash;
+	hashTableNode *curNode, **nodeAddr;
+	BlobHeader *header;
+	void *grown;
+	s32 returnCode;
+	u32 x, chain = 0;
+	if(ht==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	if( (blob==0) && blobLen ){
+		return hashTable_errorNullParam4;
+	}
+	if((ht->flags & hashTable_flagBlobValues)==0){
+		return hashTable_errorNoBlobValues;
+	}
+	if(blobLen > BLOB_MAX){
+		return hashTable_errorMallocFailed;
+	}
+	
+	returnCode = checkSizeToGrow(ht);
+	
+	hash = hashKey(ht, key, keyLen);
+	maskedHash = hash & getMask(ht->size);
+	if( ht->snapshot && snapshotPrepare(ht, maskedHash) ){
+		return hashTable_errorMallocFailed;
+	}
+	nodeAddr = &ht->table[maskedHash];
+	for(curNode = *nodeAddr; curNode; curNode = *nodeAddr){
+		if(keyCmp(key, keyLen, hash, curNode->key, curNode->keyLen,
+			curNode->hash)==0){
+			break;
+		}
+		nodeAddr = &curNode->next;
+		chain++;
+	}
+	if(curNode){
+		if(blobLen > nodeBlob(curNode)->cap){
+			grown = growNode(ht, curNode, getNodeSize(keyLen)
+				+sizeof(BlobHeader)+blobCapFor(blobLen));
+			if(grown==0){
+				return hashTable_errorMallocFailed;
+			}
+			curNode = grown;
+			*nodeAddr = curNode;
+			nodeBlob(curNode)->cap = blobCapFor(blobLen);
+		}
+		returnCode = hashTable_updatedValOfExistingKey;
+	} else {
+		curNode = makeNode(ht, key, keyLen, 0, hash, blobCapFor(blobLen));
+		if(curNode==0){
+			return hashTable_errorMallocFailed;
+		}
+		*nodeAddr = curNode;
+	}
+	header = nodeBlob(curNode);
+	for(x = 0; x < blobLen; x++){
+		((u8*)(header+1))[x] = ((const u8*)blob)[x];
+	}
+	header->len = blobLen;
+	if(ht->hook){
+		ht->hook(ht->hookCtx, hashTable_opInsert, curNode->key, keyLen,
+			curNode->value);
+	}
+	if( (returnCode != hashTable_updatedValOfExistingKey)
+		&& (chain >= HASHTABLE_MAX_CHAIN)
+		&& (ht->flags & hashTable_flagHardened) ){
+		reseedTable(ht);
+	}
+	return returnCode;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_findBlob(
+	HashTable *ht,
+	u8        *key,
+	u8        keyLen,
+	u8        **blob,
+	u32       *blobLen)
+{
+	hashTableNode *node;
+	s32 returnCode;
+	if( (ht!=0) && ((ht->flags & hashTable_flagBlobValues)==0) ){
+		return hashTable_errorNoBlobValues;
+	}
+	if( (blob==0) || (blobLen==0) ){
+		return hashTable_errorNullParam4;
+	}
+	returnCode = hashTable_find(ht, key, keyLen, &node);
+	if(returnCode == hashTable_OK){
+		*blob = hashTable_nodeBlob(node, blobLen);
+	}
+	return returnCode;
+}
+
+HASHTABLE_STATIC_BUILD
+u8 *
+hashTable_nodeBlob(hashTableNode *node, u32 *blobLen)
+{
+	BlobHeader *header = nodeBlob(node);
+	if(blobLen){
+		*blobLen = header->len;
+	}
+	return (u8*)(header+1);
+}
+
+/*******************************************************************************
+ * Section Freeze
+ * PTHash style minimal perfect hash. Keys are split in to buckets of about
+ * FROZEN_BUCKET_LOAD keys, buckets are placed largest first and each gets the
+ * first pilot value that sends all of its keys to free slots.
+*******************************************************************************/
+
+#define FROZEN_BUCKET_LOAD (4)
+#define FROZEN_MAGIC       "HTFROZE2"
+
+typedef struct FrozenHeader {
+	u8  magic[8];
+	u64 seed;
+	u32 flags;
+	u32 count;
+	u32 bucketCount;
+	u32 keyBytes;
+} FrozenHeader;
+
+typedef struct FrozenEntry {
+	u64           mixed;
+	hashTableNode *node;
+} FrozenEntry;
+
+// murmur3 fmix64, spreads weak hash output bits over the whole word
+static inline u64
+mix64(u64 x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccd;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53;
+	x ^= x >> 33;
+	return x;
+}
+
+// map 32 random bits on to [0, range) without division
+static inline u32
+fastRange(u32 x, u32 range)
+{
+	return ((u64)x * range) >> 32;
+}
+
+static inline u32
+frozenBucket(u64 mixed, u32 bucketCount)
+{
+	return fastRange(mixed >> 32, bucketCount);
+}
+
+// mixed again after the pilot so each pilot moves every key of a bucket
+// independently, as in PTHash
+static inline u32
+frozenSlot(u64 mixed, u32 pilot, u32 count)
+{
+	return fastRange((u32)(mix64(mixed ^ mix64(pilot)) >> 32), count);
+}
+
+static u64
+frozenSize(u32 count, u32 bucketCount, u32 keyBytes)
+{
+	return (u64)count*sizeof(HtValue) + (u64)bucketCount*4
+		+ ((u64)count+1)*4 + keyBytes;
+}
+
+// point the arrays of ft in to memory laid out as frozenSize describes
+static void
+frozenSetArrays(HashTableFrozen *ft, u8 *memory)
+{
+	ft->values = (HtValue*)memory;
+	memory += (u64)ft->count*sizeof(HtValue);
+	ft->pilots = (u32*)memory;
+	memory += (u64)ft->bucketCount*4;
+	ft->keyOffsets = (u32*)memory;
+	memory += ((u64)ft->count+1)*4;
+	ft->keys = memory;
+}
+
+static s32
+frozenFindPilots(
+	FrozenEntry *entries,
+	u32         *bucketStart,
+	u32         count,
+	u32         bucketCount,
+	u32         *pilots,
+	u32         *slotEntry)
+{
+	u32 *order, *sizeStart, *taken, *slots;
+	u32 b, x, y, size, maxSize = 0, pilot;
+	FrozenEntry *bucket;
+	s32 returnCode = hashTable_OK;
+
+	for(b = 0; b < bucketCount; b++){
+		size = bucketStart[b+1]-bucketStart[b];
+		if(size > maxSize){
+			maxSize = size;
+		}
+	}
+	order = HASHTABLE_MALLOC((u64)bucketCount*4);
+	sizeStart = HASHTABLE_CALLOC(maxSize+2, 4);
+	taken = HASHTABLE_CALLOC((count+31)/32+1, 4);
+	slots = HASHTABLE_MALLOC((u64)maxSize*4+4);
+	if( (order==0) || (sizeStart==0) || (taken==0) || (slots==0) ){
+		returnCode = hashTable_errorMallocFailed;
+		goto DONE;
+	}
+	// counting sort of the buckets, largest first
+	for(b = 0; b < bucketCount; b++){
+		sizeStart[maxSize-(bucketStart[b+1]-bucketStart[b])+1]++;
+	}
+	for(x = 1; x <= maxSize+1; x++){
+		sizeStart[x] += sizeStart[x-1];
+	}
+	for(b = 0; b < bucketCount; b++){
+		order[sizeStart[maxSize-(bucketStart[b+1]-bucketStart[b])]++] = b;
+	}
+	for(x = 0; x < bucketCount; x++){
+		b = order[x];
+		bucket = &entries[bucketStart[b]];
+		size = bucketStart[b+1]-bucketStart[b];
+		pilots[b] = 0;
+		if(size == 0){
+			continue;
+		}
+		// only keys with the same full hash collide for every pilot
+		for(y = 1; y < size; y++){
+			if(bucket[y].mixed == bucket[y-1].mixed){
+				returnCode = hashTable_errorCannotFreeze;
+				goto DONE;
+			}
+		}
+		for(pilot = 0; ; pilot++){
+			for(y = 0; y < size; y++){
+				slots[y] = frozenSlot(bucket[y].mixed, pilot, count);
+				if(taken[slots[y]/32] & (1u<<(slots[y]%32))){
+					break;
+				}
+				// mark now so keys of this bucket cannot share a slot
+				taken[slots[y]/32] |= (1u<<(slots[y]%32));
+			}
+			if(y == size){
+				break;
+			}
+			while(y){
+				y--;
+				taken[slots[y]/32] &= ~(1u<<(slots[y]%32));
+			}
+			if(pilot == 0xFFFFFFFF){
+				returnCode = hashTable_errorCannotFreeze;
+				goto DONE;
+			}
+		}
+		pilots[b] = pilot;
+		for(y = 0; y < size; y++){
+			slotEntry[slots[y]] = bucketStart[b]+y;
+		}
+	}
+	DONE:
+	HASHTABLE_FREE(order);
+	HASHTABLE_FREE(sizeStart);
+	HASHTABLE_FREE(taken);
+	HASHTABLE_FREE(slots);
+	return returnCode;
+}
+
+// sort entries of each bucket by hash so duplicates sit next to each other
+static void
+frozenSortBucket(FrozenEntry *bucket, u32 size)
+{
+	FrozenEntry tmp;
+	u32 x, y;
+	for(x = 1; x < size; x++){
+		tmp = bucket[x];
+		y = x;
+		while( (y > 0) && (bucket[y-1].mixed > tmp.mixed) ){
+			bucket[y] = bucket[y-1];
+			y--;
+		}
+		bucket[y] = tmp;
+	}
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_freeze(HashTable *ht, HashTableFrozen **ft_p)
+{
+	HashTableFrozen *ft;
+	FrozenEntry *entries = 0, *sorted = 0;
+	u32 *bucketStart = 0, *slotEntry = 0, *offsets;
+	hashTableNode *node;
+	u64 keyBytes = 0, bucket;
+	u32 x, b, count, bucketCount;
+	u8 *keys;
+	HtValue *values;
+	s32 returnCode;
+	if(ht==0){
+		return hashTable_errorNullParam1;
+	}
+	if(ft_p==0){
+		return hashTable_errorNullParam2;
+	}
+	if(ht->flags & hashTable_flagBlobValues){
+		// frozen tables have no room for blobs
+		return hashTable_errorCannotFreeze;
+	}
+	if(ht->count >= 0xFFFFFFFF){
+		// slots and key offsets are 32 bit
+		return hashTable_errorCannotFreeze;
+	}
+	count = ht->count;
+	bucketCount = ((u64)count+FROZEN_BUCKET_LOAD-1)/FROZEN_BUCKET_LOAD;
+	if(bucketCount == 0){
+		bucketCount = 1;
+	}
+	ft = HASHTABLE_CALLOC(1, sizeof(HashTableFrozen));
+	entries = HASHTABLE_MALLOC((u64)count*sizeof(FrozenEntry)+1);
+	sorted = HASHTABLE_MALLOC((u64)count*sizeof(FrozenEntry)+1);
+	bucketStart = HASHTABLE_CALLOC((u64)bucketCount+2, 4);
+	slotEntry = HASHTABLE_MALLOC((u64)count*4+1);
+	if( (ft==0) || (entries==0) || (sorted==0) || (bucketStart==0)
+		|| (slotEntry==0) ){
+		returnCode = hashTable_errorMallocFailed;
+		goto FAIL;
+	}
+	// gather every node, the stored hash is reused
+	count = 0;
+	for(bucket = 0; bucket < ht->size; bucket++){
+		for(node = ht->table[bucket]; node; node = node->next){
+			entries[count].mixed = mix64(node->hash);
+			entries[count].node = node;
+			keyBytes += node->keyLen;
+			bucketStart[frozenBucket(entries[count].mixed, bucketCount)+2]++;
+			count++;
+		}
+	}
+	if(keyBytes > 0xFFFFFFFF){
+		returnCode = hashTable_errorCannotFreeze;
+		goto FAIL;
+	}
+	// counting sort of the entries by bucket
+	for(b = 2; b < bucketCount+2; b++){
+		bucketStart[b] += bucketStart[b-1];
+	}
+	for(x = 0; x < count; x++){
+		sorted[bucketStart[frozenBucket(entries[x].mixed, bucketCount)+1]++] =
+			entries[x];
+	}
+	for(b = 0; b < bucketCount; b++){
+		frozenSortBucket(&sorted[bucketStart[b]], bucketStart[b+1]-bucketStart[b]);
+	}
+	ft->seed = ht->seed;
+	ft->flags = ht->flags & hashTable_flagHardened;
+	ft->count = count;
+	ft->bucketCount = bucketCount;
+	ft->keyBytes = keyBytes;
+	ft->memory = HASHTABLE_MALLOC(frozenSize(count, bucketCount, keyBytes));
+	if(ft->memory==0){
+		returnCode = hashTable_errorMallocFailed;
+		goto FAIL;
+	}
+	frozenSetArrays(ft, ft->memory);
+	returnCode = frozenFindPilots(sorted, bucketStart, count, bucketCount,
+		(u32*)ft->pilots, slotEntry);
+	if(returnCode){
+		goto FAIL;
+	}
+	// pack keys and values in slot order
+	values = (HtValue*)ft->values;
+	offsets = (u32*)ft->keyOffsets;
+	keys = (u8*)ft->keys;
+	offsets[0] = 0;
+	for(x = 0; x < count; x++){
+		node = sorted[slotEntry[x]].node;
+		values[x] = node->value;
+		for(b = 0; b < node->keyLen; b++){
+			keys[offsets[x]+b] = node->key[b];
+		}
+		offsets[x+1] = offsets[x]+node->keyLen;
+	}
+	HASHTABLE_FREE(entries);
+	HASHTABLE_FREE(sorted);
+	HASHTABLE_FREE(bucketStart);
+	HASHTABLE_FREE(slotEntry);
+	*ft_p = ft;
+	return hashTable_OK;
+	
+	FAIL:
+	if(ft){
+		HASHTABLE_FREE(ft->memory);
+	}
+	HASHTABLE_FREE(ft);
+	HASHTABLE_FREE(entries);
+	HASHTABLE_FREE(sorted);
+	HASHTABLE_FREE(bucketStart);
+	HASHTABLE_FREE(slotEntry);
+	return returnCode;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_findFrozen(
+	const HashTableFrozen *ft,
+	u8                    *key,
+	u8                    keyLen,
+	HtValue               *value)
+{
+	u64 mixed;
+	u32 slot, offset;
+	if(ft==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	if(value==0){
+		return hashTable_errorNullParam4;
+	}
+	if(ft->count == 0){
+		return hashTable_nothingFound;
+	}
+	mixed = mix64(hashWith(ft->flags, ft->seed, key, keyLen));
+	slot = frozenSlot(mixed, ft->pilots[frozenBucket(mixed, ft->bucketCount)],
+		ft->count);
+	offset = ft->keyOffsets[slot];
+	if( (ft->keyOffsets[slot+1]-offset != keyLen)
+		|| HT_CMP(key, (u8*)&ft->keys[offset], keyLen) ){
+		return hashTable_nothingFound;
+	}
+	*value = ft->values[slot];
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_findFrozenIntKey(
+	const HashTableFrozen *ft,
+	s64                   key,
+	HtValue               *value)
+{
+	u8 keyBuffer[16];
+	u8 keyLen = hashTable_s64toString(key, keyBuffer);
+	return hashTable_findFrozen(ft, keyBuffer, keyLen, value);
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_serializeFrozen(
+	const HashTableFrozen *ft,
+	u8                    **buffer_p,
+	u64                   *length_p)
+{
+	FrozenHeader *header;
+	u8 *buffer, *dest, *src;
+	u64 length, x;
+	if(ft==0){
+		return hashTable_errorNullParam1;
+	}
+	if(buffer_p==0){
+		return hashTable_errorNullParam2;
+	}
+	if(length_p==0){
+		return hashTable_errorNullParam3;
+	}
+	length = sizeof(FrozenHeader)
+		+ frozenSize(ft->count, ft->bucketCount, ft->keyBytes);
+	buffer = HASHTABLE_MALLOC(length);
+	if(buffer==0){
+		return hashTable_errorMallocFailed;
+	}
+	header = (FrozenHeader*)buffer;
+	for(x = 0; x < 8; x++){
+		header->magic[x] = FROZEN_MAGIC[x];
+	}
+	header->seed = ft->seed;
+	header->flags = ft->flags;
+	header->count = ft->count;
+	header->bucketCount = ft->bucketCount;
+	header->keyBytes = ft->keyBytes;
+	// arrays may live in separate allocations (generated tables), copy each
+	dest = buffer+sizeof(FrozenHeader);
+	src = (u8*)ft->values;
+	for(x = 0; x < (u64)ft->count*sizeof(HtValue); x++){ *dest++ = src[x]; }
+	src = (u8*)ft->pilots;
+	for(x = 0; x < (u64)ft->bucketCount*4; x++){ *dest++ = src[x]; }
+	src = (u8*)ft->keyOffsets;
+	for(x = 0; x < ((u64)ft->count+1)*4; x++){ *dest++ = src[x]; }
+	src = (u8*)ft->keys;
+	for(x = 0; x < ft->keyBytes; x++){ *dest++ = src[x]; }
+	*buffer_p = buffer;
+	*length_p = length;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_deserializeFrozen(
+	u8              *buffer,
+	u64             length,
+	HashTableFrozen **ft_p)
+{
+	FrozenHeader *header = (FrozenHeader*)buffer;
+	HashTableFrozen *ft;
+	u32 x;
+	if(buffer==0){
+		return hashTable_errorNullParam1;
+	}
+	if(ft_p==0){
+		return hashTable_errorNullParam3;
+	}
+	if( (length < sizeof(FrozenHeader)) || ((uintptr_t)buffer % 8) ){
+		return hashTable_errorCorrupt;
+	}
+	for(x = 0; x < 8; x++){
+		if(header->magic[x] != (u8)FROZEN_MAGIC[x]){
+			return hashTable_errorCorrupt;
+		}
+	}
+	// count+1 key offsets are indexed with a u32
+	if( (header->bucketCount == 0) || ((u64)header->count+1 > 0xFFFFFFFF)
+		|| (length != sizeof(FrozenHeader)
+		+ frozenSize(header->count, header->bucketCount, header->keyBytes)) ){
+		return hashTable_errorCorrupt;
+	}
+	ft = HASHTABLE_CALLOC(1, sizeof(HashTableFrozen));
+	if(ft==0){
+		return hashTable_errorMallocFailed;
+	}
+	ft->seed = header->seed;
+	ft->flags = header->flags;
+	ft->count = header->count;
+	ft->bucketCount = header->bucketCount;
+	ft->keyBytes = header->keyBytes;
+	frozenSetArrays(ft, buffer+sizeof(FrozenHeader));
+	// every key must lie inside the key bytes, find trusts the offsets
+	if( (ft->keyOffsets[0] != 0) || (ft->keyOffsets[ft->count] != ft->keyBytes) ){
+		HASHTABLE_FREE(ft);
+		return hashTable_errorCorrupt;
+	}
+	for(x = 0; x < ft->count; x++){
+		if( (ft->keyOffsets[x+1] < ft->keyOffsets[x])
+			|| (ft->keyOffsets[x+1]-ft->keyOffsets[x] > 255) ){
+			HASHTABLE_FREE(ft);
+			return hashTable_errorCorrupt;
+		}
+	}
+	*ft_p = ft;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+void
+hashTable_freeFrozen(HashTableFrozen **ft_p)
+{
+	HashTableFrozen *ft;
+	if( (ft_p==0) || (*ft_p==0) ){
+		return;
+	}
+	ft = *ft_p;
+	*ft_p = 0;
+	HASHTABLE_FREE(ft->memory);
+	HASHTABLE_FREE(ft);
+}
+
+/*******************************************************************************
+ * Section Snapshot
+*******************************************************************************/
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_snapshot(HashTable *ht, HashTableSnapshot **snap_p)
+{
+	HashTableSnapshot *snap;
+	if(ht==0){
+		return hashTable_errorNullParam1;
+	}
+	if(snap_p==0){
+		return hashTable_errorNullParam2;
+	}
+	if(ht->snapshot){
+		return hashTable_errorSnapshotActive;
+	}
+	snap = HASHTABLE_MALLOC(sizeof(HashTableSnapshot));
+	if(snap==0){
+		return hashTable_errorMallocFailed;
+	}
+	// one zeroed block, large ones are fresh zero pages and cost no writes
+	snap->segments = HASHTABLE_CALLOC(segmentCount(ht->size), ENTRY_SIZE+1);
+	if(snap->segments==0){
+		HASHTABLE_FREE(snap);
+		return hashTable_errorMallocFailed;
+	}
+	snap->locks = (u8*)(snap->segments+segmentCount(ht->size));
+	snap->ht = ht;
+	snap->table = ht->table;
+	snap->tableMapped = 0;
+	snap->slabs = 0;
+	snap->seed = ht->seed;
+	snap->flags = ht->flags;
+	snap->size = ht->size;
+	snap->count = ht->count;
+	snap->ownsTable = 0;
+	ht->snapshot = snap;
+	*snap_p = snap;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_findSnapshot(
+	HashTableSnapshot *snap,
+	u8                *key,
+	u8                keyLen,
+	HtValue           *value)
+{
+	hashTableNode **heads, *curNode;
+	u64 hash, maskedHash, segment;
+	s32 returnCode = hashTable_nothingFound;
+	if(snap==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	if(value==0){
+		return hashTable_errorNullParam4;
+	}
+	hash = hashWith(snap->flags, snap->seed, key, keyLen);
+	maskedHash = hash & getMask(snap->size);
+	segment = maskedHash/SEGMENT_SIZE;
+	heads = __atomic_load_n(&snap->segments[segment], __ATOMIC_ACQUIRE);
+	if(heads){
+		// copied segments never change
+		curNode = heads[maskedHash%SEGMENT_SIZE];
+	} else {
+		snapshotLock(snap, segment);
+		heads = snap->segments[segment];
+		curNode = heads ? heads[maskedHash%SEGMENT_SIZE]
+		                : snap->table[maskedHash];
+	}
+	for(; curNode; curNode = curNode->next){
+		if(keyCmp(key, keyLen, hash,
+			curNode->key, curNode->keyLen, curNode->hash)==0){
+			*value = curNode->value;
+			returnCode = hashTable_OK;
+			break;
+		}
+	}
+	if(heads==0){
+		snapshotUnlock(snap, segment);
+	}
+	return returnCode;
+}
+
+HASHTABLE_STATIC_BUILD
+void
+hashTable_traverseSnapshot(
+	HashTableSnapshot *snap,
+	hashTable_visitFn function,
+	void              *parameter)
+{
+	hashTableNode **heads, *curNode;
+	u64 segment;
+	u32 buckets, x, stop = 0;
+	if( (snap==0) || (function==0) ){
+		return;
+	}
+	for(segment = 0; (segment < segmentCount(snap->size)) && !stop; segment++){
+		buckets = segmentBuckets(snap, segment);
+		heads = __atomic_load_n(&snap->segments[segment], __ATOMIC_ACQUIRE);
+		if(heads==0){
+			snapshotLock(snap, segment);
+			heads = snap->segments[segment];
+			if(heads==0){
+				// live segment, the writer waits until this walk is done
+				for(x = 0; (x < buckets) && !stop; x++){
+					curNode = snap->table[segment*SEGMENT_SIZE+x];
+					for(; curNode && !stop; curNode = curNode->next){
+						stop = function(curNode, parameter);
+					}
+				}
+				snapshotUnlock(snap, segment);
+				continue;
+			}
+			snapshotUnlock(snap, segment);
+		}
+		for(x = 0; (x < buckets) && !stop; x++){
+			for(curNode = heads[x]; curNode && !stop; curNode = curNode->next){
+				stop = function(curNode, parameter);
+			}
+		}
+	}
+}
+
+HASHTABLE_STATIC_BUILD
+void
+hashTable_releaseSnapshot(HashTableSnapshot **snap_p)
+{
+	HashTableSnapshot *snap;
+	u64 segment;
+	u32 buckets, x;
+	if( (snap_p==0) || (*snap_p==0) ){
+		return;
+	}
+	snap = *snap_p;
+	*snap_p = 0;
+	if(snap->ht){
+		snap->ht->snapshot = 0;
+		snapshotCatchUp(snap->ht);
+	}
+	for(segment = 0; segment < segmentCount(snap->size); segment++){
+		buckets = segmentBuckets(snap, segment);
+		if(snap->segments[segment]){
+			freeSegment(snap->segments[segment], buckets);
+		} else if(snap->ownsTable){
+			for(x = 0; x < buckets; x++){
+				freeChain(snap->slabs, snap->table[segment*SEGMENT_SIZE+x]);
+			}
+		}
+	}
+	if(snap->ownsTable){
+		freeTable(snap->table, snap->tableMapped);
+		slabsFree(snap->slabs);
+	}
+	HASHTABLE_FREE(snap->segments);
+	HASHTABLE_FREE(snap);
+}
+
+/*******************************************************************************
+ * Section Node Compaction
+*******************************************************************************/
+
+// Whether next is away from where a compaction pass would put it: right after
+// node, or at the start of the next slab when node filled the last one.
+static u8
+linkSplit(u32 flags, HashTableSlabs *slabs, hashTableNode *node)
+{
+	hashTableNode *next = node->next;
+	u32 index;
+	if( (next==0) || ((u8*)next == (u8*)node+nodeBytes(flags, node)) ){
+		return 0;
+	}
+	if( (nodeBytes(flags, node) > SLAB_NODE_MAX)
+		|| (nodeBytes(flags, next) > SLAB_NODE_MAX) ){
+		// large nodes are never moved
+		return 0;
+	}
+	if(slabs==0){
+		return 1;
+	}
+	index = slabFind(slabs, next);
+	return (index == slabs->count) || (slabs->slabs[index].base != (u8*)next);
+}
+
+// chains in the heap, split up, or in a slab less than half live are moved
+static u8
+chainNeedsMove(HashTableSlabs *slabs, hashTableNode *curNode)
+{
+	Slab *slab;
+	u32 index;
+	for(; curNode; curNode = curNode->next){
+		if(nodeBytes(slabs->flags, curNode) <= SLAB_NODE_MAX){
+			index = slabFind(slabs, curNode);
+			if(index == slabs->count){
+				return 1;
+			}
+			slab = &slabs->slabs[index];
+			if( (index != slabs->fill) && (slab->live < slab->used/2) ){
+				return 1;
+			}
+		}
+		if(linkSplit(slabs->flags, slabs, curNode)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// copy the nodes of one bucket to the end of the fill slab, in chain order
+static s32
+moveChain(HashTable *ht, u64 bucket, u64 *work)
+{
+	HashTableSlabs *slabs = ht->slabs;
+	hashTableNode **link = &ht->table[bucket], *curNode, *copy;
+	u32 bytes, x;
+	for(curNode = *link; curNode; curNode = *link){
+		bytes = nodeBytes(ht->flags, curNode);
+		if(bytes <= SLAB_NODE_MAX){
+			copy = slabAlloc(slabs, bytes);
+			if(copy==0){
+				return hashTable_errorMallocFailed;
+			}
+			for(x = 0; x < bytes/8; x++){
+				((u64*)copy)[x] = ((u64*)curNode)[x];
+			}
+			*link = copy;
+			freeNode(slabs, curNode);
+			curNode = copy;
+			(*work)++;
+		}
+		link = &curNode->next;
+	}
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_compact(HashTable *ht, u64 budget)
+{
+	HashTableSlabs *slabs;
+	u64 work = 0;
+	s32 returnCode;
+	if(ht==0){
+		return hashTable_errorNullParam1;
+	}
+	if(ht->slabs==0){
+		ht->slabs = HASHTABLE_CALLOC(1, sizeof(HashTableSlabs));
+		if(ht->slabs==0){
+			return hashTable_errorMallocFailed;
+		}
+		ht->slabs->flags = ht->flags;
+		ht->slabs->changes = ht->resizes + ht->reseeds;
+	}
+	slabs = ht->slabs;
+	slabs->numaNodes = ht->numaNodes;
+	if(slabs->changes != ht->resizes + ht->reseeds){
+		// bucket order changed under the pass, start again
+		slabs->changes = ht->resizes + ht->reseeds;
+		slabs->cursor = 0;
+	}
+	while(slabs->cursor < ht->size){
+		if( budget && (work >= budget) ){
+			return hashTable_compactPending;
+		}
+		if(chainNeedsMove(slabs, ht->table[slabs->cursor])){
+			if( ht->snapshot && snapshotPrepare(ht, slabs->cursor) ){
+				return hashTable_errorMallocFailed;
+			}
+			returnCode = moveChain(ht, slabs->cursor, &work);
+			if(returnCode){
+				return returnCode;
+			}
+		}
+		work++;
+		slabs->cursor++;
+	}
+	slabs->cursor = 0;
+#ifdef GLIBC_MALLOC
+	malloc_trim(0);
+#endif
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+void
+hashTable_getFragmentation(HashTable *ht, HashTableFragmentation *report)
+{
+	HashTableSlabs *slabs;
+	hashTableNode *curNode;
+	u64 x;
+	if( (ht==0) || (report==0) ){
+		return;
+	}
+	slabs = ht->slabs;
+	report->nodeBytes = 0;
+	report->heapNodes = 0;
+	report->slabBytes = 0;
+	report->slabLiveBytes = 0;
+	report->links = 0;
+	report->splitLinks = 0;
+	report->heapFreeBytes = 0;
+	report->cursor = slabs ? slabs->cursor : 0;
+	for(x = 0; x < ht->size; x++){
+		for(curNode = ht->table[x]; curNode; curNode = curNode->next){
+			report->nodeBytes += nodeBytes(ht->flags, curNode);
+			if( (slabs==0) || (slabFind(slabs, curNode) == slabs->count) ){
+				report->heapNodes++;
+			}
+			if(curNode->next){
+				report->links++;
+				report->splitLinks += linkSplit(ht->flags, slabs, curNode);
+			}
+		}
+	}
+	if(slabs){
+		for(x = 0; x < slabs->count; x++){
+			report->slabBytes += SLAB_SIZE;
+			report->slabLiveBytes += slabs->slabs[x].live;
+		}
+	}
+#if defined(GLIBC_MALLOC) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+	report->heapFreeBytes = mallinfo2().fordblks;
+#endif
+}
+
+/*******************************************************************************
+ * Section Compact Table
+*******************************************************************************/
+
+typedef struct CompactEntry {
+	u32     next;
+	u32     tag;     // low 32 bits of the mixed hash
+	HtValue value;
+	u8      keyLen;
+	u8      key[7];
+} CompactEntry;
+
+#define COMPACT_MIN_POOL (4096)
+#define KEY_OFFSET       (__builtin_offsetof(CompactEntry, key))
+
+static inline u32
+compactUnits(u32 keyLen)
+{
+	return (KEY_OFFSET+keyLen+7)/8;
+}
+
+static inline CompactEntry *
+compactEntry(HashTableCompact *ct, u32 index)
+{
+	return (CompactEntry*)(ct->pool+index);
+}
+
+// the fnv low bits carry the last key bytes, mix so the top bits do too
+static inline u64
+compactHash(HashTableCompact *ct, u8 *key, u8 keyLen)
+{
+	return mix64(HT_HASH(key, keyLen, ct->seed));
+}
+
+// the top half picks the bucket, the low half is the tag, so no tag bit is
+// implied by the chain an entry sits in
+static inline u32
+compactBucket(u64 hash, u32 shift)
+{
+	return (u32)(hash >> 32) >> shift;
+}
+
+static u32
+compactAlloc(HashTableCompact *ct, u32 units)
+{
+	u64 *pool;
+	u64 newCap;
+	u32 index = ct->freeLists[units];
+	if(index){
+		ct->freeLists[units] = compactEntry(ct, index)->next;
+		return index;
+	}
+	if(ct->poolUsed+(u64)units > ct->poolCap){
+		newCap = (u64)ct->poolCap*2;
+		if(newCap > 0xFFFFFFFF){
+			newCap = 0xFFFFFFFF;
+		}
+		if(ct->poolUsed+(u64)units > newCap){
+			return 0;
+		}
+		pool = HASHTABLE_REALLOC(ct->pool, newCap*8);
+		if(pool==0){
+			return 0;
+		}
+		ct->pool = pool;
+		ct->poolCap = newCap;
+	}
+	index = ct->poolUsed;
+	ct->poolUsed += units;
+	return index;
+}
+
+static s32
+compactResize(HashTableCompact *ct, u32 newSize, u32 newShift)
+{
+	u32 *buckets, *oldBuckets = ct->buckets;
+	u32 x, index, next, bucket;
+	CompactEntry *entry;
+	buckets = HASHTABLE_CALLOC(newSize, 4);
+	if(buckets==0){
+		return hashTable_errorCannotMakeNewTable;
+	}
+	for(x = 0; x < ct->size; x++){
+		for(index = oldBuckets[x]; index; index = next){
+			entry = compactEntry(ct, index);
+			next = entry->next;
+			bucket = compactBucket(compactHash(ct, entry->key, entry->keyLen),
+				newShift);
+			entry->next = buckets[bucket];
+			buckets[bucket] = index;
+		}
+	}
+	HASHTABLE_FREE(oldBuckets);
+	ct->buckets = buckets;
+	ct->size = newSize;
+	ct->shift = newShift;
+	return hashTable_OK;
+}
+
+// walk a chain, returns the address of the link holding the match or of the
+// terminating 0
+static inline u32 *
+compactSearch(HashTableCompact *ct, u8 *key, u8 keyLen, u64 hash)
+{
+	u32 *link = &ct->buckets[compactBucket(hash, ct->shift)];
+	CompactEntry *entry;
+	while(*link){
+		entry = compactEntry(ct, *link);
+		if( (entry->tag == (u32)hash) && (entry->keyLen == keyLen)
+			&& (HT_CMP(key, entry->key, keyLen) == 0) ){
+			break;
+		}
+		link = &entry->next;
+	}
+	return link;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_initCompact(HashTableCompact **ct_p)
+{
+	HashTableCompact *ct;
+	u32 x;
+	if(ct_p==0){
+		return hashTable_errorNullParam1;
+	}
+	ct = HASHTABLE_MALLOC(sizeof(HashTableCompact));
+	if(ct==0){
+		return hashTable_errorMallocFailed;
+	}
+	ct->size = BASE_SIZE/ENTRY_SIZE;
+	ct->shift = 32-__builtin_ctz(ct->size);
+	ct->buckets = HASHTABLE_CALLOC(ct->size, 4);
+	ct->pool = HASHTABLE_MALLOC((u64)COMPACT_MIN_POOL*8);
+	if( (ct->buckets==0) || (ct->pool==0) ){
+		HASHTABLE_FREE(ct->buckets);
+		HASHTABLE_FREE(ct->pool);
+		HASHTABLE_FREE(ct);
+		return hashTable_errorMallocFailed;
+	}
+	ct->seed = 0xcbf29ce484222325;
+	ct->count = 0;
+	ct->poolUsed = 1;
+	ct->poolCap = COMPACT_MIN_POOL;
+	for(x = 0; x < HASHTABLE_COMPACT_CLASSES; x++){
+		ct->freeLists[x] = 0;
+	}
+	*ct_p = ct;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_insertCompact(
+	HashTableCompact *ct,
+	u8               *key,
+	u8               keyLen,
+	HtValue          value)
+{
+	CompactEntry *entry;
+	u64 hash;
+	u32 *link, index, x;
+	s32 returnCode = hashTable_OK;
+	if(ct==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	if( (ct->count+1 > ct->size) && (ct->shift > 0) ){
+		returnCode = compactResize(ct, ct->size*2, ct->shift-1);
+	}
+	hash = compactHash(ct, key, keyLen);
+	link = compactSearch(ct, key, keyLen, hash);
+	if(*link){
+		compactEntry(ct, *link)->value = value;
+		return hashTable_updatedValOfExistingKey;
+	}
+	index = compactAlloc(ct, compactUnits(keyLen));
+	if(index==0){
+		return hashTable_errorMallocFailed;
+	}
+	entry = compactEntry(ct, index);
+	entry->tag = (u32)hash;
+	entry->value = value;
+	entry->keyLen = keyLen;
+	for(x = 0; x < keyLen; x++){
+		entry->key[x] = key[x];
+	}
+	// the pool may have moved, link was only valid to test for a match
+	entry->next = ct->buckets[compactBucket(hash, ct->shift)];
+	ct->buckets[compactBucket(hash, ct->shift)] = index;
+	ct->count++;
+	return returnCode;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_findCompact(
+	HashTableCompact *ct,
+	u8               *key,
+	u8               keyLen,
+	HtValue          *value)
+{
+	u32 *link;
+	if(ct==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	if(value==0){
+		return hashTable_errorNullParam4;
+	}
+	link = compactSearch(ct, key, keyLen, compactHash(ct, key, keyLen));
+	if(*link==0){
+		return hashTable_nothingFound;
+	}
+	*value = compactEntry(ct, *link)->value;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_deleteCompact(
+	HashTableCompact *ct,
+	u8               *key,
+	u8               keyLen,
+	HtValue          *value)
+{
+	CompactEntry *entry;
+	u32 *link, index, units;
+	if(ct==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	link = compactSearch(ct, key, keyLen, compactHash(ct, key, keyLen));
+	index = *link;
+	if(index==0){
+		return hashTable_nothingFound;
+	}
+	entry = compactEntry(ct, index);
+	if(value){
+		*value = entry->value;
+	}
+	*link = entry->next;
+	units = compactUnits(entry->keyLen);
+	entry->next = ct->freeLists[units];
+	ct->freeLists[units] = index;
+	ct->count--;
+	if( (ct->size > 8) && (ct->count < ct->size/4) ){
+		// a failed shrink leaves a larger table that still works
+		compactResize(ct, ct->size/2, ct->shift+1);
+	}
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+u64
+hashTable_bytesCompact(HashTableCompact *ct)
+{
+	return (u64)ct->size*4 + (u64)ct->poolUsed*8;
+}
+
+HASHTABLE_STATIC_BUILD
+void
+hashTable_freeCompact(HashTableCompact **ct_p)
+{
+	HashTableCompact *ct;
+	if( (ct_p==0) || (*ct_p==0) ){
+		return;
+	}
+	ct = *ct_p;
+	*ct_p = 0;
+	HASHTABLE_FREE(ct->buckets);
+	HASHTABLE_FREE(ct->pool);
+	HASHTABLE_FREE(ct);
+}
+
+/*******************************************************************************
+ * Section Dense Table
+*******************************************************************************/
+
+#define DENSE_EMPTY     (0)
+#define DENSE_DUMMY     (0xFFFFFFFF)
+#define DENSE_NONE      (0xFFFFFFFF)
+#define DENSE_MIN_INDEX (16)
+
+// CPython style probing, the perturbation brings in the high hash bits
+static u32
+denseProbe(HashTableDense *dt, u8 *key, u8 keyLen, u64 hash, u32 *insertSlot)
+{
+	HashTableDenseEntry *entry;
+	u32 mask = dt->indexSize-1, slot = hash & mask, stored;
+	u32 freeSlot = DENSE_NONE;
+	u64 perturb = hash;
+	while(1){
+		stored = dt->index[slot];
+		if(stored == DENSE_EMPTY){
+			*insertSlot = (freeSlot != DENSE_NONE) ? freeSlot : slot;
+			return DENSE_NONE;
+		}
+		if(stored == DENSE_DUMMY){
+			if(freeSlot == DENSE_NONE){
+				freeSlot = slot;
+			}
+		} else {
+			entry = &dt->entries[stored-1];
+			if(keyCmp(key, keyLen, hash, dt->keys+entry->keyOffset,
+				entry->keyLen, entry->hash)==0){
+				return slot;
+			}
+		}
+		perturb >>= 5;
+		slot = (slot*5 + perturb + 1) & mask;
+	}
+}
+
+// index at most 2/3 full counting deleted slots
+static inline u32
+denseIndexSizeFor(u32 count)
+{
+	u64 size = DENSE_MIN_INDEX;
+	while(size*2 < (u64)count*3+3){
+		size *= 2;
+	}
+	return size;
+}
+
+static void
+denseFillIndex(HashTableDense *dt, u32 *index, u32 newSize)
+{
+	u32 mask = newSize-1, slot, x;
+	u64 perturb;
+	for(x = 0; x < dt->used; x++){
+		if(dt->entries[x].keyLen == 0){
+			continue;
+		}
+		perturb = dt->entries[x].hash;
+		slot = perturb & mask;
+		while(index[slot]){
+			perturb >>= 5;
+			slot = (slot*5 + perturb + 1) & mask;
+		}
+		index[slot] = x+1;
+	}
+	HASHTABLE_FREE(dt->index);
+	dt->index = index;
+	dt->indexSize = newSize;
+	dt->indexUsed = dt->count;
+}
+
+// Squeeze out deleted entries and their keys keeping the order, then rebuild
+// the index. The new index is allocated first so failure changes nothing.
+static s32
+denseRebuild(HashTableDense *dt, u32 newSize, u8 squeeze)
+{
+	HashTableDenseEntry *entry;
+	u32 *index, x, y, live = 0, keyBytes = 0;
+	index = HASHTABLE_CALLOC(newSize, 4);
+	if(index==0){
+		return hashTable_errorCannotMakeNewTable;
+	}
+	for(x = 0; squeeze && (x < dt->used); x++){
+		entry = &dt->entries[x];
+		if(entry->keyLen == 0){
+			continue;
+		}
+		// offsets grow with position, so keys only ever move down
+		for(y = 0; y <= entry->keyLen; y++){
+			dt->keys[keyBytes+y] = dt->keys[entry->keyOffset+y];
+		}
+		entry->keyOffset = keyBytes;
+		keyBytes += entry->keyLen+1;
+		dt->entries[live++] = *entry;
+	}
+	if(squeeze){
+		dt->used = live;
+		dt->keyBytes = keyBytes;
+	}
+	denseFillIndex(dt, index, newSize);
+	return hashTable_OK;
+}
+
+static s32
+denseGrow(void **array, u32 *cap, u64 need, u32 elementSize)
+{
+	void *grown;
+	u64 newCap = *cap;
+	if(newCap >= need){
+		return hashTable_OK;
+	}
+	while(newCap < need){
+		newCap *= 2;
+	}
+	if(newCap > 0xFFFFFFFF){
+		return hashTable_errorMallocFailed;
+	}
+	grown = HASHTABLE_REALLOC(*array, newCap*elementSize);
+	if(grown==0){
+		return hashTable_errorMallocFailed;
+	}
+	*array = grown;
+	*cap = newCap;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_initDense(HashTableDense **dt_p)
+{
+	HashTableDense *dt;
+	if(dt_p==0){
+		return hashTable_errorNullParam1;
+	}
+	dt = HASHTABLE_MALLOC(sizeof(HashTableDense));
+	if(dt==0){
+		return hashTable_errorMallocFailed;
+	}
+	dt->entryCap = DENSE_MIN_INDEX/2;
+	dt->keyCap = BASE_SIZE;
+	dt->indexSize = DENSE_MIN_INDEX;
+	dt->entries = HASHTABLE_MALLOC(dt->entryCap*sizeof(HashTableDenseEntry));
+	dt->keys = HASHTABLE_MALLOC(dt->keyCap);
+	dt->index = HASHTABLE_CALLOC(dt->indexSize, 4);
+	if( (dt->entries==0) || (dt->keys==0) || (dt->index==0) ){
+		HASHTABLE_FREE(dt->entries);
+		HASHTABLE_FREE(dt->keys);
+		HASHTABLE_FREE(dt->index);
+		HASHTABLE_FREE(dt);
+		return hashTable_errorMallocFailed;
+	}
+	dt->seed = 0xcbf29ce484222325;
+	dt->count = 0;
+	dt->used = 0;
+	dt->indexUsed = 0;
+	dt->keyBytes = 0;
+	*dt_p = dt;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_insertDense(
+	HashTableDense *dt,
+	u8             *key,
+	u8             keyLen,
+	HtValue        value)
+{
+	HashTableDenseEntry *entry;
+	u64 hash;
+	u32 slot, insertSlot, x;
+	u8 rebuilt = 0;
+	s32 returnCode = hashTable_OK;
+	if(dt==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	hash = HT_HASH(key, keyLen, dt->seed);
+	slot = denseProbe(dt, key, keyLen, hash, &insertSlot);
+	if(slot != DENSE_NONE){
+		dt->entries[dt->index[slot]-1].value = value;
+		return hashTable_updatedValOfExistingKey;
+	}
+	if(dt->used == dt->entryCap){
+		if( (dt->used-dt->count >= dt->used/4)
+			&& (denseRebuild(dt, denseIndexSizeFor(dt->count+1), 1) == 0) ){
+			rebuilt = 1;
+		}
+		if( (dt->used == dt->entryCap) && denseGrow((void**)&dt->entries,
+			&dt->entryCap, (u64)dt->used+1, sizeof(HashTableDenseEntry)) ){
+			return hashTable_errorMallocFailed;
+		}
+	}
+	if( denseGrow((void**)&dt->keys, &dt->keyCap,
+		(u64)dt->keyBytes+keyLen+1, 1) ){
+		return hashTable_errorMallocFailed;
+	}
+	if( (u64)(dt->indexUsed+1)*3 > (u64)dt->indexSize*2 ){
+		// only the index is rebuilt, entries and keys stay where they are
+		returnCode = denseRebuild(dt, denseIndexSizeFor(dt->count+1), 0);
+		rebuilt |= (returnCode == hashTable_OK);
+		if( returnCode && ((u64)dt->indexUsed+1 >= dt->indexSize) ){
+			return returnCode;
+		}
+	}
+	if(rebuilt){
+		denseProbe(dt, key, keyLen, hash, &insertSlot);
+	}
+	entry = &dt->entries[dt->used];
+	entry->hash = hash;
+	entry->value = value;
+	entry->keyOffset = dt->keyBytes;
+	entry->keyLen = keyLen;
+	for(x = 0; x < keyLen; x++){
+		dt->keys[dt->keyBytes+x] = key[x];
 	}
+	dt->keys[dt->keyBytes+keyLen] = 0;
+	dt->keyBytes += keyLen+1;
+	if(dt->index[insertSlot] == DENSE_EMPTY){
+		dt->indexUsed++;
+	}
+	dt->index[insertSlot] = dt->used+1;
+	dt->used++;
+	dt->count++;
+	return returnCode;
 }
 
 HASHTABLE_STATIC_BUILD
 s32
-hashTable_insert(
-	HashTable *ht,
-	u8        *key,
-	u8        keyLen,
-	HtValue   value)
+hashTable_findDense(
+	HashTableDense *dt,
+	u8             *key,
+	u8             keyLen,
+	HtValue        *value)
 {
-	if(ht==0){
+	u32 slot, insertSlot;
+	if(dt==0){
 		return hashTable_errorNullParam1;
 	}
 	if(key==0){
@@ -300,74 +2889,29 @@ hashTable_insert(
 	if(keyLen==0){
 		return hashTable_errorNullParam3;
 	}
-	return HashTable_insert_internal(ht, key, keyLen, value);
-}
-
-HASHTABLE_STATIC_BUILD
-s32
-hashTable_insertIntKey(
-	HashTable *ht,
-	s64       key,
-	HtValue   value)
-{
-	u8 keyBuffer[16];
-	u8 keyLen;
-	if(ht==0){
-		return hashTable_errorNullParam1;
+	if(value==0){
+		return hashTable_errorNullParam4;
 	}
-	keyLen = hashTable_s64toString(key, keyBuffer);
-	return HashTable_insert_internal(ht, keyBuffer, keyLen, value);
-}
-
-/*******************************************************************************
- * Section Find
-*******************************************************************************/
-
-static hashTableNode *
-hashTable_find_internal(
-	HashTable *ht,
-	u8        *key,
-	u8        keyLen)
-{
-	u64 hash, maskedHash;
-	hashTableNode *curNode;
-	
-	hash = HT_HASH(key, keyLen, ht->seed);
-	// search for existing key
-	maskedHash = hash & getMask(ht->size);
-	curNode = ht->table[maskedHash];
-	
-	// something exists,  might be key
-	while (1) {
-		if (curNode == 0)
-		{
-			// nothing exists
-			return 0;
-		}
-		if(keyCmp(
-			key,
-			keyLen,
-			hash,
-			curNode->key,
-			curNode->keyLen,
-			curNode->hash)==0){
-			// key does exist, return key
-			return curNode;
-		}
-		curNode=curNode->next;
+	slot = denseProbe(dt, key, keyLen, HT_HASH(key, keyLen, dt->seed),
+		&insertSlot);
+	if(slot == DENSE_NONE){
+		return hashTable_nothingFound;
 	}
+	*value = dt->entries[dt->index[slot]-1].value;
+	return hashTable_OK;
 }
 
 HASHTABLE_STATIC_BUILD
 s32
-hashTable_find(
-	HashTable      *ht,
+hashTable_deleteDense(
+	HashTableDense *dt,
 	u8             *key,
-	u8              keyLen,
-	hashTableNode **result)
+	u8             keyLen,
+	HtValue        *value)
 {
-	hashTableNode *internalResult;
-	if(ht==0){
+	HashTableDenseEntry *entry;
+	u32 slot, insertSlot;
+	if(dt==0){
 		return hashTable_errorNullParam1;
 	}
 	if(key==0){
@@ -376,120 +2920,348 @@ hashTable_find(
 	if(keyLen==0){
 		return hashTable_errorNullParam3;
 	}
-	if(result==0){
-		return hashTable_errorNullParam4;
-	}
-	
-	internalResult = hashTable_find_internal(ht, key, keyLen);
-	if(internalResult==0){
+	slot = denseProbe(dt, key, keyLen, HT_HASH(key, keyLen, dt->seed),
+		&insertSlot);
+	if(slot == DENSE_NONE){
 		return hashTable_nothingFound;
 	}
-	
-	*result = internalResult;
+	entry = &dt->entries[dt->index[slot]-1];
+	if(value){
+		*value = entry->value;
+	}
+	entry->keyLen = 0;
+	dt->index[slot] = DENSE_DUMMY;
+	dt->count--;
+	if( (dt->used >= DENSE_MIN_INDEX) && (dt->count < dt->used/4) ){
+		// on failure the deleted entries just stay a while longer
+		denseRebuild(dt, denseIndexSizeFor(dt->count), 1);
+	}
 	return hashTable_OK;
 }
 
-
-
 HASHTABLE_STATIC_BUILD
-s32
-hashTable_findIntKey(
-	HashTable     *ht,
-	s64           key,
-	hashTableNode **result)
+void
+hashTable_freeDense(HashTableDense **dt_p)
 {
-	u8 keyBuffer[16];
-	u8 keyLen = hashTable_s64toString(key, keyBuffer);
-	return hashTable_find(ht, keyBuffer, keyLen, result);
+	HashTableDense *dt;
+	if( (dt_p==0) || (*dt_p==0) ){
+		return;
+	}
+	dt = *dt_p;
+	*dt_p = 0;
+	HASHTABLE_FREE(dt->entries);
+	HASHTABLE_FREE(dt->keys);
+	HASHTABLE_FREE(dt->index);
+	HASHTABLE_FREE(dt);
 }
 
 /*******************************************************************************
- * Section Deletion
+ * Section Join and Set Operations
 *******************************************************************************/
 
-static s32
-hashTable_delete_internal(
-	HashTable *ht,
-	u8        *key,
-	u8        keyLen,
-	HtValue   *value)
+#define JOIN_BATCH       (16)
+#define JOIN_MAX_THREADS (64)
+// buckets each thread should get at least
+#define JOIN_MIN_RANGE   (4096)
+
+enum {
+	joinEmitMatch, // probe keys found in build
+	joinEmitMiss,  // probe keys missing from build
+	joinEmitAll    // every probe key, with its match or 0
+};
+
+typedef struct JoinTask {
+	HashTable        *probe;
+	HashTable        *build;
+	HashTable        *result;     // inserted in to directly, one thread only
+	hashTable_joinFn function;
+	void             *parameter;
+	hashTableNode    **collected; // nodes for result, gathered by threads
+	u64              collectedCount;
+	u64              collectedCap;
+	u32              *stop;       // shared, set when function asks to stop
+	u64              first;       // probe bucket range
+	u64              last;
+	s32              error;
+	u8               emit;
+	u8               swapped;     // probe is the second table
+	u8               reuseHash;
+	u8               collect;
+} JoinTask;
+
+static void
+joinEmit(JoinTask *task, hashTableNode *probeNode, hashTableNode *match)
 {
-	u64 hash, maskedHash;
-	hashTableNode **curSlotAddr, *node;
+	hashTableNode *left = task->swapped ? match : probeNode;
+	hashTableNode *right = task->swapped ? probeNode : match;
+	hashTableNode *keep = left ? left : right;
+	hashTableNode **grown;
 	s32 returnCode;
-	
-	returnCode = checkSizeToShrink(ht);
-	
-	hash = HT_HASH(key, keyLen, ht->seed);
-	// search for existing key
-	maskedHash = hash & getMask(ht->size);
-	curSlotAddr = &ht->table[maskedHash];
-	
-	// something exists,  might be key
-	while (1){
-		node = *curSlotAddr;
-		if (node == 0)
-		{
-			// nothing exists
-			return hashTable_nothingFound;
+	if( task->function && task->function(left, right, task->parameter) ){
+		__atomic_store_n(task->stop, 1, __ATOMIC_RELAXED);
+	}
+	if(task->collect){
+		if(task->collectedCount == task->collectedCap){
+			task->collectedCap = task->collectedCap ? task->collectedCap*2 : 1024;
+			grown = HASHTABLE_REALLOC(task->collected,
+				task->collectedCap*sizeof(hashTableNode*));
+			if(grown==0){
+				task->error = hashTable_errorMallocFailed;
+				__atomic_store_n(task->stop, 1, __ATOMIC_RELAXED);
+				return;
+			}
+			task->collected = grown;
 		}
-		if(keyCmp(
-			key,
-			keyLen,
-			hash,
-			node->key,
-			node->keyLen,
-			node->hash)==0){
-			// key does exist, delete key
-			// if passed a pointer write out value
-			if(value){
-				*value = node->value;
+		task->collected[task->collectedCount++] = keep;
+	} else if(task->result){
+		returnCode = hashTable_insert(task->result, keep->key, keep->keyLen,
+			keep->value);
+		if(returnCode < 0){
+			task->error = returnCode;
+			__atomic_store_n(task->stop, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// look a batch of probe nodes up in build, prefetching each level first
+static void
+joinBatch(JoinTask *task, hashTableNode **nodes, u32 n)
+{
+	HashTable *build = task->build;
+	hashTableNode **slots[JOIN_BATCH], *heads[JOIN_BATCH], *curNode;
+	u64 hashes[JOIN_BATCH];
+	u64 mask = getMask(build->size);
+	u32 x;
+	u8 found;
+	for(x = 0; x < n; x++){
+		hashes[x] = task->reuseHash ? nodes[x]->hash
+			: hashKey(build, nodes[x]->key, nodes[x]->keyLen);
+		slots[x] = &build->table[hashes[x] & mask];
+		__builtin_prefetch(slots[x]);
+	}
+	for(x = 0; x < n; x++){
+		heads[x] = *slots[x];
+		if(heads[x]){
+			__builtin_prefetch(heads[x]);
+		}
+	}
+	for(x = 0; x < n; x++){
+		if(__atomic_load_n(task->stop, __ATOMIC_RELAXED)){
+			return;
+		}
+		found = 0;
+		for(curNode = heads[x]; curNode; curNode = curNode->next){
+			if(keyCmp(nodes[x]->key, nodes[x]->keyLen, hashes[x],
+				curNode->key, curNode->keyLen, curNode->hash)==0){
+				found = 1;
+				break;
 			}
-			// over write memory with next address
-			*curSlotAddr = node->next;
+		}
+		if( (task->emit == joinEmitAll)
+			|| (found == (task->emit == joinEmitMatch)) ){
+			joinEmit(task, nodes[x], curNode);
+		}
+	}
+}
 
-			HASHTABLE_FREE(node);
-			ht->count--;
-			return returnCode;
+static void *
+joinRange(void *arg)
+{
+	JoinTask *task = arg;
+	hashTableNode *batch[JOIN_BATCH], *curNode;
+	u64 x;
+	u32 n = 0;
+	for(x = task->first; x < task->last; x++){
+		if(__atomic_load_n(task->stop, __ATOMIC_RELAXED)){
+			return 0;
+		}
+		for(curNode = task->probe->table[x]; curNode; curNode = curNode->next){
+			batch[n++] = curNode;
+			if(n == JOIN_BATCH){
+				joinBatch(task, batch, n);
+				n = 0;
+			}
 		}
-		curSlotAddr = &node->next;
 	}
+	if(n){
+		joinBatch(task, batch, n);
+	}
+	return 0;
 }
 
-HASHTABLE_STATIC_BUILD
-s32
-hashTable_delete(
-	HashTable *ht,
-	u8        *key,
-	u8        keyLen,
-	HtValue   *value)
-{	
-	if(ht==0){
+// run one probe pass, split over threads, then fill result in order
+static s32
+joinPass(
+	HashTable        *probe,
+	HashTable        *build,
+	HashTable        *result,
+	hashTable_joinFn function,
+	void             *parameter,
+	u32              threads,
+	u8               emit,
+	u8               swapped,
+	u32              *stop)
+{
+	JoinTask tasks[JOIN_MAX_THREADS];
+	pthread_t ids[JOIN_MAX_THREADS];
+	u8 started[JOIN_MAX_THREADS];
+	u64 y, range;
+	u32 x;
+	s32 returnCode = hashTable_OK, insertCode;
+	hashTableNode *node;
+	if(threads > probe->size/JOIN_MIN_RANGE){
+		threads = probe->size/JOIN_MIN_RANGE;
+	}
+	if(threads > JOIN_MAX_THREADS){
+		threads = JOIN_MAX_THREADS;
+	}
+	if(threads == 0){
+		threads = 1;
+	}
+	range = (probe->size+threads-1)/threads;
+	for(x = 0; x < threads; x++){
+		tasks[x].probe = probe;
+		tasks[x].build = build;
+		tasks[x].result = result;
+		tasks[x].function = function;
+		tasks[x].parameter = parameter;
+		tasks[x].collected = 0;
+		tasks[x].collectedCount = 0;
+		tasks[x].collectedCap = 0;
+		tasks[x].stop = stop;
+		tasks[x].first = x*range;
+		tasks[x].last = (x == threads-1) ? probe->size : (x+1)*range;
+		tasks[x].error = hashTable_OK;
+		tasks[x].emit = emit;
+		tasks[x].swapped = swapped;
+		tasks[x].reuseHash = (probe->seed == build->seed) && ((probe->flags
+			^ build->flags) & hashTable_flagHardened) == 0;
+		tasks[x].collect = (result != 0) && (threads > 1);
+		started[x] = (x > 0) && (pthread_create(&ids[x], 0, joinRange,
+			&tasks[x]) == 0);
+	}
+	// this thread takes the first range and any that failed to start
+	for(x = 0; x < threads; x++){
+		if(!started[x]){
+			joinRange(&tasks[x]);
+		}
+	}
+	for(x = 0; x < threads; x++){
+		if(started[x]){
+			pthread_join(ids[x], 0);
+		}
+		if(tasks[x].error && (returnCode == hashTable_OK)){
+			returnCode = tasks[x].error;
+		}
+		for(y = 0; (y < tasks[x].collectedCount) && (returnCode == 0); y++){
+			node = tasks[x].collected[y];
+			insertCode = hashTable_insert(result, node->key, node->keyLen,
+				node->value);
+			if(insertCode < 0){
+				returnCode = insertCode;
+			}
+		}
+		HASHTABLE_FREE(tasks[x].collected);
+	}
+	return returnCode;
+}
+
+static s32
+joinCheck(HashTable *a, HashTable *b)
+{
+	if(a==0){
 		return hashTable_errorNullParam1;
 	}
-	if(key==0){
+	if(b==0){
 		return hashTable_errorNullParam2;
 	}
-	if(keyLen==0){
-		return hashTable_errorNullParam3;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_intersect(
+	HashTable        *a,
+	HashTable        *b,
+	HashTable        *result,
+	hashTable_joinFn function,
+	void             *parameter,
+	u32              threads)
+{
+	u32 stop = 0;
+	s32 returnCode = joinCheck(a, b);
+	if(returnCode){
+		return returnCode;
 	}
-	return hashTable_delete_internal(ht, key, keyLen, value);
+	// walk the smaller table, look up in the larger
+	if(a->count <= b->count){
+		return joinPass(a, b, result, function, parameter, threads,
+			joinEmitMatch, 0, &stop);
+	}
+	return joinPass(b, a, result, function, parameter, threads,
+		joinEmitMatch, 1, &stop);
 }
 
 HASHTABLE_STATIC_BUILD
 s32
-hashTable_deleteIntKey(
-	HashTable *ht,
-	s64       key,
-	HtValue   *value)
+hashTable_union(
+	HashTable        *a,
+	HashTable        *b,
+	HashTable        *result,
+	hashTable_joinFn function,
+	void             *parameter,
+	u32              threads)
 {
-	u8 keyBuffer[16];
-	u8 keyLen;
-	if(ht==0){
-		return hashTable_errorNullParam1;
+	u32 stop = 0;
+	s32 returnCode = joinCheck(a, b);
+	if(returnCode){
+		return returnCode;
 	}
-	keyLen = hashTable_s64toString(key, keyBuffer);
-	return hashTable_delete_internal(ht, keyBuffer, keyLen, value);
+	// every key of a with its partner, then the keys only b has
+	returnCode = joinPass(a, b, result, function, parameter, threads,
+		joinEmitAll, 0, &stop);
+	if( (returnCode == hashTable_OK) && (stop == 0) ){
+		returnCode = joinPass(b, a, result, function, parameter, threads,
+			joinEmitMiss, 1, &stop);
+	}
+	return returnCode;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_difference(
+	HashTable        *a,
+	HashTable        *b,
+	HashTable        *result,
+	hashTable_joinFn function,
+	void             *parameter,
+	u32              threads)
+{
+	u32 stop = 0;
+	s32 returnCode = joinCheck(a, b);
+	if(returnCode){
+		return returnCode;
+	}
+	return joinPass(a, b, result, function, parameter, threads,
+		joinEmitMiss, 0, &stop);
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTable_join(
+	HashTable        *probe,
+	HashTable        *build,
+	hashTable_joinFn function,
+	void             *parameter,
+	u32              threads)
+{
+	u32 stop = 0;
+	s32 returnCode = joinCheck(probe, build);
+	if(returnCode){
+		return returnCode;
+	}
+	return joinPass(probe, build, 0, function, parameter, threads,
+		joinEmitMatch, 0, &stop);
 }
 
 /*******************************************************************************
@@ -511,12 +3283,49 @@ hashTable_setSeed(HashTable *ht, u64 seed)
 }
 
 HASHTABLE_STATIC_BUILD
-u32
+void
+hashTable_getStats(HashTable *ht, HashTableStats *stats)
+{
+	stats->count   = ht->count;
+	stats->size    = ht->size;
+	stats->resizes = ht->resizes;
+	stats->reseeds = ht->reseeds;
+	stats->tablePageSize = ht->tablePageSize;
+}
+
+HASHTABLE_STATIC_BUILD
+void
+hashTable_setNumaNodes(HashTable *ht, u64 nodeMask)
+{
+	ht->numaNodes = nodeMask;
+}
+
+HASHTABLE_STATIC_BUILD
+void
+hashTable_setHook(HashTable *ht, hashTable_hookFn hook, void *ctx)
+{
+	ht->hook = hook;
+	ht->hookCtx = ctx;
+}
+
+HASHTABLE_STATIC_BUILD
+u64
 hashTable_getCount(HashTable *ht)
 {
 	return ht->count;
 }
 
+HASHTABLE_STATIC_BUILD
+u64
+hashTable_nodeSize(HashTable *ht, u8 keyLen, u32 blobLen)
+{
+	u64 size = getNodeSize(keyLen);
+	if(ht->flags & hashTable_flagBlobValues){
+		size += sizeof(BlobHeader)+blobCapFor(blobLen);
+	}
+	return size;
+}
+
 /*******************************************************************************
  * Section Utilities
 *******************************************************************************/
@@ -526,7 +3335,8 @@ u32
 hashTable_maxChain(HashTable *ht)
 {
 	hashTableNode **table;
-	u32 chainCount, size, max, x;
+	u64 size, x;
+	u32 chainCount, max;
 	hashTableNode *curNode;
 	if(ht==0){
 		return 0;
@@ -552,12 +3362,12 @@ hashTable_maxChain(HashTable *ht)
 }
 
 HASHTABLE_STATIC_BUILD
-u32
+u64
 hashTable_countEachNode(HashTable *ht)
 {
 	hashTableNode **table;
 	hashTableNode *curNode;
-	u32 count, size, x;
+	u64 count, size, x;
 	if(ht==0){
 		return 0;
 	}
@@ -581,9 +3391,10 @@ void
 hashTable_freeAll(HashTable **ht_p)
 {
 	HashTable *ht;
+	HashTableSnapshot *snap;
 	hashTableNode **table;
 	hashTableNode *curNode, *prevNode;
-	u32 size, x;
+	u64 size, x;
 	if (ht_p==0) {
 		return;
 	}
@@ -591,17 +3402,31 @@ hashTable_freeAll(HashTable **ht_p)
 	*ht_p = 0;
 	table = ht->table;
 	size = ht->size;
+	snap = ht->snapshot;
 	for(x = 0; x < size; x++)
 	{
+		// segments the snapshot still reads from here are handed over to it
+		if(snap && (snap->segments[x/SEGMENT_SIZE]==0)){
+			continue;
+		}
 		curNode = table[x];
 		while(curNode){
 			// there is atleast one thing here
 			prevNode = curNode;
 			curNode = curNode->next;
-			HASHTABLE_FREE(prevNode);
+			freeNode(ht->slabs, prevNode);
 		}
 	}
-	HASHTABLE_FREE(table);
+	if(snap){
+		snap->ht = 0;
+		snap->ownsTable = 1;
+		snap->tableMapped = ht->tableMapped;
+		snap->slabs = ht->slabs;
+	} else {
+		freeTable(table, ht->tableMapped);
+		slabsFree(ht->slabs);
+	}
+	HASHTABLE_FREE(ht->instrument);
 	HASHTABLE_FREE(ht);
 }
 
@@ -693,6 +3518,22 @@ hashTable_debugString(s32 mainAPIReturnValue)
 		case hashTable_errorMallocFailed:
 		return (u8*)"hashTable Error: "
 					"Malloc was called and returned NULL(0).\n";
+		case hashTable_errorIo:
+		return (u8*)"hashTable Error: "
+					"A file operation failed, check errno.\n";
+		case hashTable_errorCorrupt:
+		return (u8*)"hashTable Error: "
+					"File contents failed validation.\n";
+		case hashTable_errorCannotFreeze:
+		return (u8*)"hashTable Error: "
+					"Two keys have the same full hash, or the table holds "
+					"blobs or too many keys to freeze.\n";
+		case hashTable_errorSnapshotActive:
+		return (u8*)"hashTable Error: "
+					"The table already has a snapshot attached.\n";
+		case hashTable_errorNoBlobValues:
+		return (u8*)"hashTable Error: "
+					"The table was not made with hashTable_flagBlobValues.\n";
 		case hashTable_errorCannotMakeNewTable:
 		return (u8*)"hashTable Error: "
 					"Calloc was called and returned NULL(0). Cannot make "
@@ -706,6 +3547,12 @@ hashTable_debugString(s32 mainAPIReturnValue)
 		case hashTable_updatedValOfExistingKey:
 		return (u8*)"hashTable Status: "
 					"Existing key found and value updated.\n";
+		case hashTable_spilled:
+		return (u8*)"hashTable Status: "
+					"Memory budget reached, key written to a run file.\n";
+		case hashTable_compactPending:
+		return (u8*)"hashTable Status: "
+					"Compaction budget used up, call again to go on.\n";
 		default:
 		return (u8*)"hashTable Default: This value is not enumerated."
 		       " Debug has no information for you.\n";
@@ -14,6 +14,7 @@
 #define HASHTABLE_FREE   free
 #define HASHTABLE_MALLOC malloc
 #define HASHTABLE_CALLOC calloc
+#define HASHTABLE_REALLOC realloc
 #endif
 
 #ifndef HASHTABLE_CUSTOM_TYPE
@@ -40,6 +41,21 @@ typedef uint64_t HtValue;
 
 #define BASE_SIZE (64)
 
+// bucket arrays at least this large are mapped directly when the table asks
+// for huge pages or a NUMA policy, smaller ones come from HASHTABLE_CALLOC
+#ifndef HASHTABLE_MAP_MIN
+#define HASHTABLE_MAP_MIN (2*1024*1024)
+#endif
+
+// chain length that makes a hardened table pick a new seed and rehash
+#ifndef HASHTABLE_MAX_CHAIN
+#define HASHTABLE_MAX_CHAIN (24)
+#endif
+
+// Time 1 in HASHTABLE_INSTRUMENT insert, find and delete calls, see Section
+// Instrumentation API. Left undefined no sampling code is compiled in.
+//#define HASHTABLE_INSTRUMENT (1024)
+
 /*******************************************************************************
  * Section Types
 *******************************************************************************/
@@ -54,13 +70,154 @@ typedef struct hashTableNode {
 	uint8_t       key[7];
 } hashTableNode;
 
+// node holding key, for the key a hook is given with hashTable_opInsert
+#define HASHTABLE_KEY_NODE(k) \
+	((hashTableNode*)((uint8_t*)(k)-__builtin_offsetof(hashTableNode, key)))
+
+// called after every successful mutation and every find, see hashTable_setHook
+typedef void (*hashTable_hookFn)(
+	void     *ctx,     // pointer given to hashTable_setHook
+	uint32_t op,       // hashTable_op* value
+	uint8_t  *key,     // key bytes, for an insert the key inside the node
+	uint8_t  keyLen,   // length of key in bytes
+	HtValue  value);   // value inserted, removed or found
+
+typedef struct HashTableSnapshot HashTableSnapshot;
+typedef struct HashTableInstrument HashTableInstrument;
+typedef struct HashTableSlabs HashTableSlabs;
+
 typedef struct HashTable {
 	hashTableNode **table;
+	HashTableSnapshot *snapshot; // attached snapshot or 0
+	hashTable_hookFn hook;
+	void          *hookCtx;
 	uint64_t      seed;
-	uint32_t      count;
-	uint32_t      size;
+	uint64_t      count;
+	uint64_t      size;
+	uint32_t      flags;
+	uint32_t      resizes;
+	uint32_t      reseeds;
+	uint32_t      reseedPending; // reseed deferred by an attached snapshot
+	uint32_t      tablePageSize; // page size backing table, 0 = calloc
+	uint64_t      tableMapped;   // bytes mapped for table, 0 = calloc
+	uint64_t      numaNodes;     // node mask for the NUMA flags, 0 = all
+	HashTableSlabs *slabs;       // nodes moved by hashTable_compact, or 0
+	// kept in every build so the layout does not depend on
+	// HASHTABLE_INSTRUMENT, 0 when it is undefined
+	HashTableInstrument *instrument;
 } HashTable;
 
+typedef struct HashTableStats {
+	uint64_t count;   // nodes currently stored
+	uint64_t size;    // number of bucket slots
+	uint32_t resizes; // grow and shrink events since init
+	uint32_t reseeds; // hardened tables: reseed and rehash events
+	uint32_t tablePageSize; // page size backing the bucket array, 0 = calloc
+} HashTableStats;
+
+// flags for hashTable_initWithFlags
+enum {
+	// keyed SipHash-1-3 with a random per table seed, when an insert walks a
+	// chain of HASHTABLE_MAX_CHAIN nodes the table reseeds and rehashes
+	hashTable_flagHardened = 1<<0,
+	// back large bucket arrays and the slabs of hashTable_compact with 1GB or
+	// 2MB hugetlb pages, falling back to transparent huge pages and then to
+	// normal pages
+	hashTable_flagHugePages = 1<<1,
+	// spread large bucket arrays and slabs page by page over the nodes in
+	// numaNodes
+	hashTable_flagNumaInterleave = 1<<2,
+	// place large bucket arrays and slabs only on the nodes in numaNodes
+	hashTable_flagNumaBind = 1<<3,
+	// every node carries a variable length value after its key, see Section
+	// Blob Value API
+	hashTable_flagBlobValues = 1<<4
+};
+
+// Read only table built by hashTable_freeze. A minimal perfect hash maps each
+// stored key to its own slot, so a lookup checks exactly one slot. Keys and
+// values are packed in to flat arrays in slot order.
+typedef struct HashTableFrozen {
+	const HtValue  *values;      // count values
+	const uint32_t *pilots;      // bucketCount pilots, one per hash bucket
+	const uint32_t *keyOffsets;  // count+1 offsets in to keys
+	const uint8_t  *keys;        // key bytes, no null termination
+	void           *memory;      // owned allocation or 0
+	uint64_t       seed;         // seed of the source table
+	uint32_t       flags;        // hashing flags of the source table
+	uint32_t       count;
+	uint32_t       bucketCount;
+	uint32_t       keyBytes;
+} HashTableFrozen;
+
+// bucket slots per copy on write segment of a snapshot, power of 2
+#ifndef HASHTABLE_SNAPSHOT_SEGMENT
+#define HASHTABLE_SNAPSHOT_SEGMENT (64)
+#endif
+
+// Point in time view of a HashTable. The live table copies a segment of
+// buckets in to the snapshot before it first changes it, untouched segments
+// are read from the live table. Resize and reseed wait for the release.
+struct HashTableSnapshot {
+	HashTable     *ht;        // live table while attached, 0 once detached
+	hashTableNode **table;    // bucket array of the live table when taken
+	hashTableNode ***segments;// copied segments, 0 = still in live table
+	uint8_t       *locks;     // one lock per segment, see snapshotLock
+	uint64_t      tableMapped;// table was handed over by hashTable_freeAll
+	HashTableSlabs *slabs;    // handed over with the table, holds its nodes
+	uint64_t      seed;
+	uint64_t      size;
+	uint64_t      count;
+	uint32_t      flags;
+	uint8_t       ownsTable;
+};
+
+// entry sizes of a compact table in 8 byte units, one free list each
+#define HASHTABLE_COMPACT_CLASSES (40)
+
+// Table with 32 bit links instead of pointers. Entries are packed in to one
+// pool of 8 byte units and addressed by unit index, 0 means no entry. The top
+// half of the hash picks the bucket and each entry keeps the low half as a
+// tag, so all 32 tag bits tell keys of a chain apart. A resize hashes the
+// keys again to find their new buckets. Keys are not null terminated.
+typedef struct HashTableCompact {
+	uint32_t *buckets;  // unit index of the first entry of each chain
+	uint64_t *pool;     // entries, unit 0 is never handed out
+	uint64_t seed;
+	uint32_t count;
+	uint32_t size;      // bucket count, power of 2
+	uint32_t shift;     // 32 - log2(size)
+	uint32_t poolUsed;  // units handed out or on a free list
+	uint32_t poolCap;   // units allocated
+	uint32_t freeLists[HASHTABLE_COMPACT_CLASSES];
+} HashTableCompact;
+
+// Insertion ordered table in the style of the CPython compact dict. Entries
+// are appended to one array, keys to one byte arena, and a sparse open
+// addressed index of 32 bit positions maps hashes to entries. Growing only
+// rebuilds the index, deleted entries are squeezed out when the entry array
+// fills up, keeping the order of the rest.
+typedef struct HashTableDenseEntry {
+	uint64_t hash;
+	HtValue  value;
+	uint32_t keyOffset; // key bytes at keys+keyOffset, null terminated
+	uint8_t  keyLen;    // 0 marks a deleted entry
+} HashTableDenseEntry;
+
+typedef struct HashTableDense {
+	HashTableDenseEntry *entries;
+	uint8_t  *keys;
+	uint32_t *index;     // entry position+1, 0 empty, 0xFFFFFFFF deleted
+	uint64_t seed;
+	uint32_t count;      // live entries
+	uint32_t used;       // entries appended, live or deleted
+	uint32_t entryCap;
+	uint32_t indexSize;  // power of 2
+	uint32_t indexUsed;  // index slots not empty, live or deleted
+	uint32_t keyBytes;
+	uint32_t keyCap;
+} HashTableDense;
+
 // Main Function API error enumeration
 enum {
 	// errors
@@ -70,11 +227,26 @@ enum {
 	hashTable_errorNullParam4         = -4,
 	hashTable_errorMallocFailed       = -5,
 	hashTable_errorCannotMakeNewTable = -6,
+	hashTable_errorIo                 = -7,
+	hashTable_errorCorrupt            = -8,
+	hashTable_errorCannotFreeze       = -9,
+	hashTable_errorSnapshotActive     = -10,
+	hashTable_errorNoBlobValues       = -11,
 	// worked as expected
 	hashTable_OK                      =  0,
 	// not an error, but did not work as expected
 	hashTable_nothingFound            =  1,
-	hashTable_updatedValOfExistingKey =  2
+	hashTable_updatedValOfExistingKey =  2,
+	hashTable_spilled                 =  3,
+	hashTable_compactPending          =  4
+};
+
+// operations reported to a hook
+enum {
+	hashTable_opInsert = 1,
+	hashTable_opDelete = 2,
+	hashTable_opFind = 3,    // key was found
+	hashTable_opFindMiss = 4 // key was not found, value is 0
 };
 
 /*******************************************************************************
@@ -86,6 +258,12 @@ HASHTABLE_STATIC_BUILD
 int32_t
 hashTable_init(HashTable **ht_p);
 
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_initWithFlags(
+	HashTable **ht_p,  // address to write pointer to the new table
+	uint32_t  flags);  // hashTable_flag* values or'd together
+
 HASHTABLE_STATIC_BUILD
 int32_t
 hashTable_insert(
@@ -102,6 +280,17 @@ hashTable_insertIntKey(
 	int64_t   key,    // signed integer key
 	HtValue   value); // value to be stored
 
+// Changes the value of a key already in the table, never adds a node.
+// Returns hashTable_updatedValOfExistingKey, or hashTable_nothingFound when
+// the key is missing. The hook sees an update as hashTable_opInsert.
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_update(
+	HashTable *ht,    // pointer memory holding address of tree
+	uint8_t   *key,   // pointer to string key
+	uint8_t   keyLen, // length of key in bytes(not including null)
+	HtValue   value); // value to be stored
+
 HASHTABLE_STATIC_BUILD
 int32_t
 hashTable_find(
@@ -134,6 +323,390 @@ hashTable_deleteIntKey(
 	int64_t key,     // signed integer key
 	HtValue *value); // OPTIONAL: pointer to memory for value to written
 
+/*******************************************************************************
+ * Section Blob Value API
+ * Tables made with hashTable_flagBlobValues store a byte blob in the node
+ * allocation right after the key, so a hit needs no second pointer chase.
+ * Nodes also keep their HtValue, 0 for nodes made by hashTable_insertBlob.
+ * hashTable_insert on such a table makes nodes with an empty blob. An update
+ * that fits the capacity of the node is copied in place, a larger one
+ * reallocates the node. Hooks only see the HtValue, a hook can reach the blob
+ * of an insert with hashTable_nodeBlob(HASHTABLE_KEY_NODE(key)). hashTableLog
+ * logs the blob with the value, hashTable_freeze refuses blob tables.
+*******************************************************************************/
+
+// insert or replace the blob of key, value is left alone on an update
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_insertBlob(
+	HashTable  *ht,       // table made with hashTable_flagBlobValues
+	uint8_t    *key,      // pointer to string key
+	uint8_t    keyLen,    // length of key in bytes(not including null)
+	const void *blob,     // bytes to store, may be 0 when blobLen is 0
+	uint32_t   blobLen);  // length of blob in bytes
+
+// Points *blob at the bytes inside the node, valid until the key is next
+// inserted or deleted or the table is freed.
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_findBlob(
+	HashTable *ht,        // table made with hashTable_flagBlobValues
+	uint8_t   *key,       // pointer to string key
+	uint8_t   keyLen,     // length of key in bytes(not including null)
+	uint8_t   **blob,     // address for pointer to the blob bytes
+	uint32_t  *blobLen);  // address for the blob length
+
+// blob of a node of a blob table, for use while traversing
+HASHTABLE_STATIC_BUILD
+uint8_t *
+hashTable_nodeBlob(hashTableNode *node, uint32_t *blobLen);
+
+/*******************************************************************************
+ * Section Frozen Table API
+ * Build once from a populated table, then serve lookups read only. The frozen
+ * table does not reference the source table, which can be freed.
+*******************************************************************************/
+
+// hashTable_errorCannotFreeze when two keys have the same full 64 bit hash,
+// for a blob table, or past 2^32-2 keys.
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_freeze(
+	HashTable       *ht,     // populated source table
+	HashTableFrozen **ft_p); // address to write pointer to the frozen table
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_findFrozen(
+	const HashTableFrozen *ft,    // pointer to frozen table
+	uint8_t               *key,   // pointer to string key
+	uint8_t               keyLen, // length of key in bytes(not including null)
+	HtValue               *value);// address for found value to be written
+
+// convenience function for using integer keys
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_findFrozenIntKey(
+	const HashTableFrozen *ft,    // pointer to frozen table
+	int64_t               key,    // signed integer key
+	HtValue               *value);// address for found value to be written
+
+// Write the frozen table in to one newly allocated buffer (native endian),
+// free it with HASHTABLE_FREE.
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_serializeFrozen(
+	const HashTableFrozen *ft,
+	uint8_t               **buffer_p,
+	uint64_t              *length_p);
+
+// Make a frozen table that points in to buffer, nothing is copied. The buffer
+// must be 8 byte aligned (malloc or mmap) and outlive the frozen table.
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_deserializeFrozen(
+	uint8_t         *buffer,
+	uint64_t        length,
+	HashTableFrozen **ft_p);
+
+// frees a frozen table from freeze or deserialize and sets *ft_p=0
+HASHTABLE_STATIC_BUILD
+void
+hashTable_freeFrozen(HashTableFrozen **ft_p);
+
+/*******************************************************************************
+ * Section Snapshot API
+ * hashTable_snapshot makes one zeroed allocation of a pointer and a lock per
+ * segment, about size/7 bytes. Large blocks come from fresh zero pages, so no
+ * memory is written and the call takes constant time. A writer only ever
+ * copies the segment it changes. While a snapshot is attached the table does
+ * not resize or reseed, chains grow instead, and hashTable_releaseSnapshot
+ * runs the deferred resize and reseed. One snapshot can be attached to a table
+ * at a time. Create, release and every table mutation must happen on one
+ * thread, find and traverse on the snapshot may run on any thread meanwhile.
+ * The snapshot stays valid after hashTable_freeAll of its table.
+*******************************************************************************/
+
+// callback for hashTable_traverseSnapshot, see HASHTABLE_TRAVERSAL
+typedef int32_t (*hashTable_visitFn)(hashTableNode *node, void *parameter);
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_snapshot(
+	HashTable         *ht,       // live table
+	HashTableSnapshot **snap_p); // address to write pointer to the snapshot
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_findSnapshot(
+	HashTableSnapshot *snap,   // pointer to snapshot
+	uint8_t           *key,    // pointer to string key
+	uint8_t           keyLen,  // length of key in bytes(not including null)
+	HtValue           *value); // address for found value to be written
+
+// Calls function for every node of the snapshot until it returns non zero.
+// A node is only valid during the call, copy out what is needed and do not
+// call back in to the snapshot or its table from function.
+HASHTABLE_STATIC_BUILD
+void
+hashTable_traverseSnapshot(
+	HashTableSnapshot *snap,
+	hashTable_visitFn function,
+	void              *parameter);
+
+// detaches from the live table, frees the snapshot and sets *snap_p=0
+HASHTABLE_STATIC_BUILD
+void
+hashTable_releaseSnapshot(HashTableSnapshot **snap_p);
+
+/*******************************************************************************
+ * Section Node Compaction API
+ * hashTable_compact copies nodes in bucket order in to 2MB slabs mapped like
+ * the bucket array, so each chain sits in one run of memory, and frees the old
+ * copies. Each call does a bounded amount of work and carries on from where
+ * the last one stopped, a resize starts the pass again. Chains already
+ * contiguous are skipped. A slab is unmapped once all its nodes are deleted
+ * or moved, a finished pass also hands free heap memory back with
+ * malloc_trim. Node pointers from before a call are no longer valid after it.
+*******************************************************************************/
+
+typedef struct HashTableFragmentation {
+	uint64_t nodeBytes;     // bytes of the nodes stored
+	uint64_t heapNodes;     // nodes in their own allocation
+	uint64_t slabBytes;     // bytes mapped for moved nodes
+	uint64_t slabLiveBytes; // part of slabBytes holding nodes
+	uint64_t links;         // next links in every chain
+	uint64_t splitLinks;    // links to a node not stored right after the last
+	uint64_t heapFreeBytes; // free memory kept by malloc, 0 if not known
+	uint64_t cursor;        // bucket the next hashTable_compact starts at
+} HashTableFragmentation;
+
+// Budget is units of work, each bucket visited and each node moved costs one,
+// 0 finishes the pass. hashTable_OK once the pass is finished,
+// hashTable_compactPending if the budget ran out first.
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_compact(HashTable *ht, uint64_t budget);
+
+// walks every node, cost is like hashTable_countEachNode
+HASHTABLE_STATIC_BUILD
+void
+hashTable_getFragmentation(HashTable *ht, HashTableFragmentation *report);
+
+/*******************************************************************************
+ * Section Compact Table API
+ * Same semantics and return values as the main API, for tables of small keys
+ * where pointers and per node allocation dominate memory use. Up to 32GB of
+ * entries, there is no node to hand out so find copies the value.
+*******************************************************************************/
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_initCompact(HashTableCompact **ct_p);
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_insertCompact(
+	HashTableCompact *ct,     // pointer to compact table
+	uint8_t          *key,    // pointer to string key
+	uint8_t          keyLen,  // length of key in bytes(not including null)
+	HtValue          value);  // value to be stored
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_findCompact(
+	HashTableCompact *ct,     // pointer to compact table
+	uint8_t          *key,    // pointer to string key
+	uint8_t          keyLen,  // length of key in bytes(not including null)
+	HtValue          *value); // address for found value to be written
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_deleteCompact(
+	HashTableCompact *ct,     // pointer to compact table
+	uint8_t          *key,    // pointer to string key
+	uint8_t          keyLen,  // length of key in bytes(not including null)
+	HtValue          *value); // OPTIONAL: pointer to memory for value
+
+// bytes used by buckets and pool, for comparing layouts
+HASHTABLE_STATIC_BUILD
+uint64_t
+hashTable_bytesCompact(HashTableCompact *ct);
+
+// frees the pool and buckets, frees the ct and sets *ct_p=0
+HASHTABLE_STATIC_BUILD
+void
+hashTable_freeCompact(HashTableCompact **ct_p);
+
+/*******************************************************************************
+ * Section Dense Table API
+ * Same semantics and return values as the main API. Iterate with
+ * HASHTABLE_DENSE_TRAVERSAL, entries come in insertion order.
+*******************************************************************************/
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_initDense(HashTableDense **dt_p);
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_insertDense(
+	HashTableDense *dt,     // pointer to dense table
+	uint8_t        *key,    // pointer to string key
+	uint8_t        keyLen,  // length of key in bytes(not including null)
+	HtValue        value);  // value to be stored
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_findDense(
+	HashTableDense *dt,     // pointer to dense table
+	uint8_t        *key,    // pointer to string key
+	uint8_t        keyLen,  // length of key in bytes(not including null)
+	HtValue        *value); // address for found value to be written
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_deleteDense(
+	HashTableDense *dt,     // pointer to dense table
+	uint8_t        *key,    // pointer to string key
+	uint8_t        keyLen,  // length of key in bytes(not including null)
+	HtValue        *value); // OPTIONAL: pointer to memory for value
+
+// frees the arrays, frees the dt and sets *dt_p=0
+HASHTABLE_STATIC_BUILD
+void
+hashTable_freeDense(HashTableDense **dt_p);
+
+/*******************************************************************************
+ * Section Join and Set Operation API
+ * left is a node of the first table and right a node of the second, either is
+ * 0 when its table has no such key. Return non zero to stop early.
+ *
+ * Probing walks one table bucket by bucket and looks each key up in the other
+ * in batches, prefetching bucket slots and chain heads before comparing. When
+ * both tables have the same seed and hash mode the stored node hash is used
+ * instead of hashing the key again.
+ *
+ * With threads > 1 the probed table is split in to bucket ranges, function
+ * is then called from several threads at once. result receives the keys after
+ * the threads finish, it must not be a or b. Either of result and function
+ * may be 0. Neither table may change during the call.
+*******************************************************************************/
+
+typedef int32_t (*hashTable_joinFn)(
+	hashTableNode *left,       // node of the first table or 0
+	hashTableNode *right,      // node of the second table or 0
+	void          *parameter); // pointer passed through
+
+// keys in both a and b, result gets the values of a
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_intersect(
+	HashTable        *a,
+	HashTable        *b,
+	HashTable        *result,
+	hashTable_joinFn function,
+	void             *parameter,
+	uint32_t         threads);
+
+// keys in a or b, result gets the value of a when the key is in both
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_union(
+	HashTable        *a,
+	HashTable        *b,
+	HashTable        *result,
+	hashTable_joinFn function,
+	void             *parameter,
+	uint32_t         threads);
+
+// keys in a but not in b, right is always 0
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_difference(
+	HashTable        *a,
+	HashTable        *b,
+	HashTable        *result,
+	hashTable_joinFn function,
+	void             *parameter,
+	uint32_t         threads);
+
+// Probe side hash join, function(probeNode, buildNode) for every probe key
+// found in build. The whole probe table is walked whatever the sizes.
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_join(
+	HashTable        *probe,
+	HashTable        *build,
+	hashTable_joinFn function,
+	void             *parameter,
+	uint32_t         threads);
+
+/*******************************************************************************
+ * Section Instrumentation API
+ * Only with HASHTABLE_INSTRUMENT defined. Every Nth call to insert, find or
+ * delete on a table is timed and recorded, the other calls pay one counter
+ * decrement. Ticks are rdtsc cycles on x86 and nanoseconds elsewhere.
+*******************************************************************************/
+
+#ifdef HASHTABLE_INSTRUMENT
+
+// histogram bucket x counts samples of less than 2^x ticks and at least
+// 2^(x-1), bucket 0 counts samples of 0 ticks
+#define HASHTABLE_HIST_BUCKETS (48)
+// raw samples kept, oldest are overwritten
+#define HASHTABLE_SAMPLE_RING  (256)
+
+enum {
+	hashTable_sampleInsert,
+	hashTable_sampleFind,
+	hashTable_sampleDelete,
+	hashTable_sampleOps
+};
+
+typedef struct HashTableSample {
+	uint64_t ticks;
+	uint32_t chain;   // nodes walked in the bucket
+	uint8_t  op;      // hashTable_sample* value
+	uint8_t  hit;     // key was in the table
+	uint8_t  resized; // a resize or reseed ran inside the call
+	uint8_t  pad;
+} HashTableSample;
+
+typedef struct HashTableOpHistogram {
+	uint64_t samples;
+	uint64_t hits;
+	uint64_t resized;    // samples that ran a resize or reseed
+	uint64_t chainTotal; // nodes walked over all samples
+	uint64_t maxTicks;
+	uint64_t ticks[HASHTABLE_HIST_BUCKETS];
+	uint64_t missTicks[HASHTABLE_HIST_BUCKETS]; // subset of ticks, misses
+} HashTableOpHistogram;
+
+struct HashTableInstrument {
+	HashTableOpHistogram ops[hashTable_sampleOps];
+	HashTableSample      recent[HASHTABLE_SAMPLE_RING];
+	uint64_t             recorded;  // newest is recent[(recorded-1)%RING]
+	uint32_t             countdown; // calls left until the next sample
+};
+
+// copy the histograms and recent samples out of the table
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_getInstrument(HashTable *ht, HashTableInstrument *out);
+
+// clear histograms and samples, the sampling period keeps running
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTable_resetInstrument(HashTable *ht);
+
+// upper bound in ticks under which fraction q (0 to 1) of samples fell
+HASHTABLE_STATIC_BUILD
+uint64_t
+hashTable_histogramQuantile(HashTableOpHistogram *hist, double q);
+
+#endif
+
 /*******************************************************************************
  * Section Helper/Utility Function API
 *******************************************************************************/
@@ -152,14 +725,38 @@ HASHTABLE_STATIC_BUILD
 void
 hashTable_setSeed(HashTable *ht, uint64_t seed);
 
+// copies counters out of the table, cheap, does not walk the nodes
+HASHTABLE_STATIC_BUILD
+void
+hashTable_getStats(HashTable *ht, HashTableStats *stats);
+
+// Nodes used by hashTable_flagNumaInterleave and hashTable_flagNumaBind, bit n
+// is NUMA node n, 0 means every node. Applies from the next resize.
+HASHTABLE_STATIC_BUILD
+void
+hashTable_setNumaNodes(HashTable *ht, uint64_t nodeMask);
+
+// Register a function called after every insert, update and delete that
+// changed the table and after every find, pass 0 to remove. Used by
+// hashTableLog for durability and hashTableTrace for recording.
+HASHTABLE_STATIC_BUILD
+void
+hashTable_setHook(HashTable *ht, hashTable_hookFn hook, void *ctx);
+
 // gets the count stored within the hash table
 HASHTABLE_STATIC_BUILD
-uint32_t
+uint64_t
 hashTable_getCount(HashTable *ht);
 
+// bytes allocated for a node of ht holding keyLen key bytes and blobLen blob
+// bytes, without malloc overhead, for callers budgeting memory
+HASHTABLE_STATIC_BUILD
+uint64_t
+hashTable_nodeSize(HashTable *ht, uint8_t keyLen, uint32_t blobLen);
+
 // walks hash table to manualy count nodes
 HASHTABLE_STATIC_BUILD
-uint32_t
+uint64_t
 hashTable_countEachNode(HashTable *ht);
 
 // return max chain of nodes. If you get > 8 there is room for improvement
@@ -208,7 +805,7 @@ do{ \
 	if(ht){ \
 		hashTableNode **table = ht->table; \
 		hashTableNode *node; \
-		u32 size, x; \
+		uint64_t size, x; \
 		size = ht->size; \
 		for(x = 0; x < size; x++) \
 		{ \
@@ -224,4 +821,28 @@ do{ \
 	EXIT: ;\
 }while(0)
 
+/*******************************************************************************
+ * Section Inline dense traversal MACRO API
+ * As HASHTABLE_TRAVERSAL but function takes a HashTableDenseEntry pointer, the
+ * key of an entry is at HASHTABLE_DENSE_KEY(dt, entry). Entries are visited in
+ * insertion order by one sequential pass over the entry array. Do not insert
+ * in to dt from function, that may move the arrays.
+*******************************************************************************/
+
+#define HASHTABLE_DENSE_KEY(dt, entry) ((dt)->keys+(entry)->keyOffset)
+
+#define HASHTABLE_DENSE_TRAVERSAL(dt, function, parameter) \
+do{ \
+	if(dt){ \
+		HashTableDenseEntry *entry = (dt)->entries; \
+		HashTableDenseEntry *end = entry + (dt)->used; \
+		for(; entry < end; entry++) \
+		{ \
+			if(entry->keyLen && function(entry, parameter)){ \
+				break; \
+			} \
+		} \
+	} \
+}while(0)
+
 #endif
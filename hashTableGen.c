@@ -0,0 +1,248 @@
+/* hashTableGen.c */
+
+// Compiles a fixed key list in to C source for a const HashTableFrozen, so the
+// table costs nothing at startup, uses no heap and sits in read only pages
+// shared by every process running the binary. Look keys up with
+// hashTable_findFrozen. The generator must be built with the same HT_HASH and
+// HT_CMP as the program using the table, and HtValue must be an integer.
+//
+// Tables use the default seed, or a random one baked in with -hardened.
+//
+// Input is one key per line, a trailing number is the value of the key,
+// otherwise the value is the line's position among the keys, from 0. Empty
+// lines and lines starting with # are skipped.
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "hashTable.h"
+
+typedef uint8_t  u8;
+typedef int8_t   s8;
+typedef uint32_t u32;
+typedef int32_t  s32;
+typedef uint64_t u64;
+typedef int64_t  s64;
+
+#define LINE_MAX_BYTES (4096)
+
+typedef struct Config {
+	const char *input;
+	const char *output;
+	const char *header;   // optional header with the extern declaration
+	const char *name;     // C identifier of the table
+	u32        flags;     // hashTable_initWithFlags flags
+} Config;
+
+// Split a line in to key and value. Returns 0 for a line to skip, -1 for a
+// key that does not fit, otherwise 1.
+static s32
+parseLine(char *line, u64 ordinal, u8 **key, u32 *keyLen, HtValue *value)
+{
+	char *end = line+strlen(line), *number, *parsed;
+	while( (end > line) && isspace((u8)end[-1]) ){
+		end--;
+	}
+	*end = 0;
+	if( (line[0] == 0) || (line[0] == '#') ){
+		return 0;
+	}
+	*value = ordinal;
+	number = end;
+	while( (number > line) && !isspace((u8)number[-1]) ){
+		number--;
+	}
+	if(number > line){
+		*value = strtoull(number, &parsed, 0);
+		if( (parsed == end) && isdigit((u8)number[0]) ){
+			end = number;
+			while( (end > line) && isspace((u8)end[-1]) ){
+				end--;
+			}
+		} else {
+			*value = ordinal;
+		}
+	}
+	*key = (u8*)line;
+	*keyLen = end-line;
+	return ( (*keyLen == 0) || (*keyLen > 255) ) ? -1 : 1;
+}
+
+static s32
+loadKeys(Config *config, HashTable *ht)
+{
+	char line[LINE_MAX_BYTES];
+	FILE *input = fopen(config->input, "r");
+	u64 lineNumber = 0, ordinal = 0;
+	u32 keyLen;
+	u8 *key;
+	HtValue value;
+	s32 returnCode;
+	if(input==0){
+		fprintf(stderr, "cannot open %s\n", config->input);
+		return 1;
+	}
+	while(fgets(line, sizeof(line), input)){
+		lineNumber++;
+		returnCode = parseLine(line, ordinal, &key, &keyLen, &value);
+		if(returnCode == 0){
+			continue;
+		}
+		if(returnCode < 0){
+			fprintf(stderr, "%s:%lu: key must be 1 to 255 bytes\n",
+				config->input, lineNumber);
+			fclose(input);
+			return 1;
+		}
+		returnCode = hashTable_insert(ht, key, keyLen, value);
+		if(returnCode != hashTable_OK){
+			fprintf(stderr, "%s:%lu: %s\n", config->input, lineNumber,
+				(returnCode == hashTable_updatedValOfExistingKey)
+				? "duplicate key" : (char*)hashTable_debugString(returnCode));
+			fclose(input);
+			return 1;
+		}
+		ordinal++;
+	}
+	fclose(input);
+	return 0;
+}
+
+static void
+emitU32s(FILE *out, const char *name, const char *suffix, const u32 *data,
+	u64 count)
+{
+	u64 x;
+	fprintf(out, "static const uint32_t %s_%s[] = {", name, suffix);
+	for(x = 0; x < count; x++){
+		fprintf(out, "%s%u,", (x%8) ? " " : "\n\t", data[x]);
+	}
+	fprintf(out, "%s};\n\n", count ? "\n" : "0");
+}
+
+static s32
+emitSource(Config *config, const HashTableFrozen *ft)
+{
+	FILE *out = fopen(config->output, "w");
+	const char *name = config->name;
+	u64 x;
+	if(out==0){
+		fprintf(stderr, "cannot create %s\n", config->output);
+		return 1;
+	}
+	fprintf(out, "/* %s, generated by hashTableGen from %s, do not edit */\n\n"
+		"#include \"hashTable.h\"\n\n", config->output, config->input);
+	fprintf(out, "static const HtValue %s_values[] = {", name);
+	for(x = 0; x < ft->count; x++){
+		fprintf(out, "%s0x%lx,", (x%4) ? " " : "\n\t", (u64)ft->values[x]);
+	}
+	fprintf(out, "%s};\n\n", ft->count ? "\n" : "0");
+	emitU32s(out, name, "pilots", ft->pilots, ft->bucketCount);
+	emitU32s(out, name, "keyOffsets", ft->keyOffsets, (u64)ft->count+1);
+	fprintf(out, "static const uint8_t %s_keys[] = {", name);
+	for(x = 0; x < ft->keyBytes; x++){
+		fprintf(out, "%s0x%02x,", (x%12) ? " " : "\n\t", ft->keys[x]);
+	}
+	fprintf(out, "%s};\n\n", ft->keyBytes ? "\n" : "0");
+	fprintf(out, "const HashTableFrozen %s = {\n"
+		"\t.values      = %s_values,\n"
+		"\t.pilots      = %s_pilots,\n"
+		"\t.keyOffsets  = %s_keyOffsets,\n"
+		"\t.keys        = %s_keys,\n"
+		"\t.memory      = 0,\n"
+		"\t.seed        = 0x%lx,\n"
+		"\t.flags       = %u,\n"
+		"\t.count       = %u,\n"
+		"\t.bucketCount = %u,\n"
+		"\t.keyBytes    = %u\n"
+		"};\n", name, name, name, name, name, ft->seed, ft->flags, ft->count,
+		ft->bucketCount, ft->keyBytes);
+	if(fclose(out)){
+		fprintf(stderr, "cannot write %s\n", config->output);
+		return 1;
+	}
+	if(config->header==0){
+		return 0;
+	}
+	out = fopen(config->header, "w");
+	if(out==0){
+		fprintf(stderr, "cannot create %s\n", config->header);
+		return 1;
+	}
+	fprintf(out, "/* %s, generated by hashTableGen from %s, do not edit */\n\n"
+		"#include \"hashTable.h\"\n\n"
+		"// %u keys, look up with hashTable_findFrozen(&%s, ...)\n"
+		"extern const HashTableFrozen %s;\n", config->header, config->input,
+		ft->count, name, name);
+	return fclose(out) ? 1 : 0;
+}
+
+static s32
+validName(const char *name)
+{
+	u32 x;
+	if( (name[0] == 0) || isdigit((u8)name[0]) ){
+		return 0;
+	}
+	for(x = 0; name[x]; x++){
+		if( !isalnum((u8)name[x]) && (name[x] != '_') ){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: hashTableGen [options] keys output.c\n"
+		"  -name ident    name of the const HashTableFrozen, default keyTable\n"
+		"  -header file   also write a header declaring the table\n"
+		"  -hardened      SipHash with a random seed baked in to the table\n");
+}
+
+int main(int argc, char **argv)
+{
+	Config config = {0, 0, 0, "keyTable", 0};
+	HashTable *ht;
+	HashTableFrozen *ft;
+	s32 x, returnCode;
+	for(x = 1; x < argc; x++){
+		if( (strcmp(argv[x], "-name") == 0) && (x+1 < argc) ){
+			config.name = argv[++x];
+		} else if( (strcmp(argv[x], "-header") == 0) && (x+1 < argc) ){
+			config.header = argv[++x];
+		} else if(strcmp(argv[x], "-hardened") == 0){
+			config.flags |= hashTable_flagHardened;
+		} else if( (argv[x][0] != '-') && (config.input == 0) ){
+			config.input = argv[x];
+		} else if( (argv[x][0] != '-') && (config.output == 0) ){
+			config.output = argv[x];
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if( (config.output == 0) || !validName(config.name) ){
+		usage();
+		return 1;
+	}
+	if(hashTable_initWithFlags(&ht, config.flags)){
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	if(loadKeys(&config, ht)){
+		return 1;
+	}
+	returnCode = hashTable_freeze(ht, &ft);
+	hashTable_freeAll(&ht);
+	if(returnCode){
+		fprintf(stderr, "hashTable_freeze: %s\n",
+			hashTable_debugString(returnCode));
+		return 1;
+	}
+	returnCode = emitSource(&config, ft);
+	hashTable_freeFrozen(&ft);
+	return returnCode;
+}
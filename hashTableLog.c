@@ -0,0 +1,854 @@
+/* hashTableLog.c */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "hashTableLog.h"
+
+typedef uint8_t  u8;
+typedef int8_t   s8;
+typedef uint32_t u32;
+typedef int32_t  s32;
+typedef uint64_t u64;
+typedef int64_t  s64;
+
+#define LOG_MAGIC     "HTLOG001"
+#define SNAP_MAGIC    "HTSNAP01"
+// snapshot of a blob table, every entry ends with the blob length and bytes
+#define SNAP_BLOB_MAGIC "HTSNAPB1"
+#define MAGIC_SIZE    (8)
+// check, op, keyLen
+#define RECORD_HEADER (4+1+1)
+#define RECORD_MAX    (RECORD_HEADER+255+sizeof(HtValue)+4)
+// insert record of a blob table, the blob length and bytes follow the value
+#define OP_INSERT_BLOB (0x80|hashTable_opInsert)
+#define DEFAULT_SYNC_OPS (1024)
+
+enum {
+	compactIdle,
+	compactRunning,
+	compactFinished
+};
+
+struct HashTableLog {
+	pthread_mutex_t lock;      // protects buffer, counters and state below
+	pthread_mutex_t syncLock;  // held around fdatasync and log rotation
+	pthread_cond_t  wake;
+	pthread_t       flusher;
+	pthread_t       compactor;
+	HashTable      *ht;
+	char           *path;
+	char           *oldPath;
+	char           *snapPath;
+	char           *tmpPath;
+	char           *newPath;
+	u8             *buf;
+	u32            bufLen;
+	u32            pendingOps;  // records written or buffered, not yet synced
+	u32            syncOps;
+	u32            syncMicros;
+	u64            logBytes;    // bytes in the active log file
+	u64            compactBytes;
+	u64            compactAt;   // active log size that starts a compaction
+	s32            fd;
+	s32            error;       // first error seen, reported by sync and close
+	u8             stop;
+	u8             hasFlusher;
+	u8             compactState;
+	u8             blobs;       // the table has hashTable_flagBlobValues
+};
+
+/*******************************************************************************
+ * Section Internal Functions
+*******************************************************************************/
+
+// fnv-1a 32, detects torn and partially written records
+static u32
+checksum(u32 hash, u8 *data, u32 len)
+{
+	u32 x;
+	for(x = 0; x < len; x++){
+		hash = (hash ^ data[x]) * 0x01000193;
+	}
+	return hash;
+}
+
+#define CHECKSUM_SEED (0x811c9dc5)
+
+static char *
+makePath(const char *path, const char *suffix)
+{
+	u32 len = strlen(path), sufLen = strlen(suffix);
+	char *new = HASHTABLE_MALLOC(len+sufLen+1);
+	if(new){
+		memcpy(new, path, len);
+		memcpy(new+len, suffix, sufLen+1);
+	}
+	return new;
+}
+
+static s32
+writeAll(s32 fd, u8 *data, u64 len)
+{
+	ssize_t written;
+	while(len){
+		written = write(fd, data, len);
+		if(written < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return hashTable_errorIo;
+		}
+		data += written;
+		len -= written;
+	}
+	return hashTable_OK;
+}
+
+// make renames and creates in the directory of path durable
+static void
+syncDirectory(const char *path)
+{
+	char dir[4096];
+	char *slash;
+	s32 fd;
+	if(strlen(path) >= sizeof(dir)){
+		return;
+	}
+	strcpy(dir, path);
+	slash = strrchr(dir, '/');
+	if(slash == 0){
+		strcpy(dir, ".");
+	} else if(slash == dir){
+		dir[1] = 0;
+	} else {
+		*slash = 0;
+	}
+	fd = open(dir, O_RDONLY);
+	if(fd >= 0){
+		fsync(fd);
+		close(fd);
+	}
+}
+
+static void
+setError(HashTableLog *log, s32 error)
+{
+	if(log->error == hashTable_OK){
+		log->error = error;
+	}
+}
+
+// make room for len bytes in *buf, which holds *cap bytes
+static s32
+reserveBytes(u8 **buf, u32 *cap, u32 len)
+{
+	u8 *grown;
+	if(len <= *cap){
+		return hashTable_OK;
+	}
+	grown = HASHTABLE_REALLOC(*buf, len);
+	if(grown==0){
+		return hashTable_errorMallocFailed;
+	}
+	*buf = grown;
+	*cap = len;
+	return hashTable_OK;
+}
+
+// caller holds log->lock
+static void
+flushLocked(HashTableLog *log)
+{
+	if(log->bufLen == 0){
+		return;
+	}
+	if(writeAll(log->fd, log->buf, log->bufLen)){
+		setError(log, hashTable_errorIo);
+	}
+	log->logBytes += log->bufLen;
+	log->bufLen = 0;
+}
+
+// caller has flushed the buffer, fsync outside of log->lock so the table
+// thread can keep appending while the disk works
+static void
+syncFile(HashTableLog *log)
+{
+	pthread_mutex_lock(&log->syncLock);
+	if(fdatasync(log->fd)){
+		pthread_mutex_lock(&log->lock);
+		setError(log, hashTable_errorIo);
+		pthread_mutex_unlock(&log->lock);
+	}
+	pthread_mutex_unlock(&log->syncLock);
+}
+
+/*******************************************************************************
+ * Section Recovery
+*******************************************************************************/
+
+// Apply every valid record of a log file to ht. A torn or corrupt record ends
+// the log, if cutTail is set the file is cut back to the last good record.
+static s32
+replayLog(HashTable *ht, const char *path, u8 cutTail)
+{
+	FILE *file;
+	struct stat info;
+	u8 record[RECORD_MAX];
+	u8 *key, *blob = 0;
+	u8 keyLen, op;
+	u32 check, len, blobLen, blobCap = 0;
+	u64 good = 0;
+	HtValue value;
+	s32 returnCode = hashTable_OK;
+
+	file = fopen(path, "rb");
+	if(file == 0){
+		return (errno == ENOENT) ? hashTable_OK : hashTable_errorIo;
+	}
+	if( (fstat(fileno(file), &info) == 0)
+		&& (fread(record, 1, MAGIC_SIZE, file) == MAGIC_SIZE)
+		&& (memcmp(record, LOG_MAGIC, MAGIC_SIZE) == 0) ){
+		good = MAGIC_SIZE;
+		while(1){
+			if(fread(record, 1, RECORD_HEADER, file) != RECORD_HEADER){
+				break;
+			}
+			op = record[4];
+			keyLen = record[5];
+			if(keyLen == 0){
+				break;
+			}
+			len = keyLen+sizeof(HtValue)+((op == OP_INSERT_BLOB) ? 4 : 0);
+			if(fread(record+RECORD_HEADER, 1, len, file) != len){
+				break;
+			}
+			blobLen = 0;
+			if(op == OP_INSERT_BLOB){
+				memcpy(&blobLen, record+RECORD_HEADER+len-4, 4);
+				// a torn length may point past the end of the file
+				if(good+RECORD_HEADER+len+blobLen > (u64)info.st_size){
+					break;
+				}
+				returnCode = reserveBytes(&blob, &blobCap, blobLen);
+				if(returnCode){
+					break;
+				}
+				if(fread(blob, 1, blobLen, file) != blobLen){
+					break;
+				}
+			}
+			memcpy(&check, record, 4);
+			if(check != checksum(checksum(CHECKSUM_SEED, record+4, 2+len),
+				blob, blobLen)){
+				break;
+			}
+			key = record+RECORD_HEADER;
+			memcpy(&value, key+keyLen, sizeof(HtValue));
+			if( (op == hashTable_opInsert) || (op == OP_INSERT_BLOB) ){
+				if(hashTable_insert(ht, key, keyLen, value)
+					== hashTable_errorMallocFailed){
+					returnCode = hashTable_errorMallocFailed;
+					break;
+				}
+				// the value is kept, only the blob is replaced
+				if(op == OP_INSERT_BLOB){
+					returnCode = hashTable_insertBlob(ht, key, keyLen, blob,
+						blobLen);
+					if(returnCode < hashTable_OK){
+						break;
+					}
+					returnCode = hashTable_OK;
+				}
+			} else if(op == hashTable_opDelete){
+				hashTable_delete(ht, key, keyLen, 0);
+			} else {
+				break;
+			}
+			good += RECORD_HEADER+len+blobLen;
+		}
+	}
+	fclose(file);
+	HASHTABLE_FREE(blob);
+	if(returnCode){
+		return returnCode;
+	}
+	if(cutTail){
+		// a header that never made it to disk is also cut, open rewrites it
+		if(truncate(path, good)){
+			return hashTable_errorIo;
+		}
+	}
+	return hashTable_OK;
+}
+
+static s32
+loadSnapshot(HashTable *ht, const char *path)
+{
+	FILE *file;
+	struct stat info;
+	u8 key[256];
+	u8 *blob = 0;
+	u8 keyLen, blobs;
+	u32 check = CHECKSUM_SEED, stored, blobLen = 0, blobCap = 0;
+	u64 offset = MAGIC_SIZE;
+	HtValue value;
+	s32 returnCode = hashTable_errorCorrupt;
+
+	file = fopen(path, "rb");
+	if(file == 0){
+		return (errno == ENOENT) ? hashTable_OK : hashTable_errorIo;
+	}
+	if( fstat(fileno(file), &info)
+		|| (fread(key, 1, MAGIC_SIZE, file) != MAGIC_SIZE)
+		|| ( (memcmp(key, SNAP_MAGIC, MAGIC_SIZE) != 0)
+		&& (memcmp(key, SNAP_BLOB_MAGIC, MAGIC_SIZE) != 0) ) ){
+		fclose(file);
+		return hashTable_errorCorrupt;
+	}
+	blobs = (memcmp(key, SNAP_BLOB_MAGIC, MAGIC_SIZE) == 0);
+	if( blobs && ((ht->flags & hashTable_flagBlobValues)==0) ){
+		fclose(file);
+		return hashTable_errorNoBlobValues;
+	}
+	while(fread(&keyLen, 1, 1, file) == 1){
+		check = checksum(check, &keyLen, 1);
+		if(keyLen == 0){
+			if( (fread(&stored, 1, 4, file) == 4) && (stored == check) ){
+				returnCode = hashTable_OK;
+			}
+			break;
+		}
+		if( (fread(key, 1, keyLen, file) != keyLen)
+			|| (fread(&value, 1, sizeof(HtValue), file) != sizeof(HtValue)) ){
+			break;
+		}
+		check = checksum(check, key, keyLen);
+		check = checksum(check, (u8*)&value, sizeof(HtValue));
+		offset += 1+keyLen+sizeof(HtValue);
+		if(blobs){
+			if(fread(&blobLen, 1, 4, file) != 4){
+				break;
+			}
+			offset += 4+(u64)blobLen;
+			if(offset > (u64)info.st_size){
+				break;
+			}
+			if(reserveBytes(&blob, &blobCap, blobLen)){
+				returnCode = hashTable_errorMallocFailed;
+				break;
+			}
+			if(fread(blob, 1, blobLen, file) != blobLen){
+				break;
+			}
+			check = checksum(check, (u8*)&blobLen, 4);
+			check = checksum(check, blob, blobLen);
+		}
+		if(hashTable_insert(ht, key, keyLen, value)
+			== hashTable_errorMallocFailed){
+			returnCode = hashTable_errorMallocFailed;
+			break;
+		}
+		if( blobs && (hashTable_insertBlob(ht, key, keyLen, blob, blobLen)
+			== hashTable_errorMallocFailed) ){
+			returnCode = hashTable_errorMallocFailed;
+			break;
+		}
+	}
+	fclose(file);
+	HASHTABLE_FREE(blob);
+	return returnCode;
+}
+
+typedef struct SnapshotWriter {
+	FILE *file;
+	u32  check;
+	u8   blobs;
+} SnapshotWriter;
+
+static s32
+writeSnapshotNode(hashTableNode *node, SnapshotWriter *writer)
+{
+	writer->check = checksum(writer->check, &node->keyLen, 1);
+	writer->check = checksum(writer->check, node->key, node->keyLen);
+	writer->check = checksum(writer->check, (u8*)&node->value,sizeof(HtValue));
+	fwrite(&node->keyLen, 1, 1, writer->file);
+	fwrite(node->key, 1, node->keyLen, writer->file);
+	fwrite(&node->value, 1, sizeof(HtValue), writer->file);
+	if(writer->blobs){
+		u32 blobLen;
+		u8 *blob = hashTable_nodeBlob(node, &blobLen);
+		writer->check = checksum(writer->check, (u8*)&blobLen, 4);
+		writer->check = checksum(writer->check, blob, blobLen);
+		fwrite(&blobLen, 1, 4, writer->file);
+		fwrite(blob, 1, blobLen, writer->file);
+	}
+	return 0;
+}
+
+// write ht to tmpPath, make it durable, then atomically replace snapPath
+static s32
+writeSnapshot(HashTable *ht, const char *tmpPath, const char *snapPath)
+{
+	SnapshotWriter writer;
+	u8 end = 0;
+	s32 failed;
+
+	writer.file = fopen(tmpPath, "wb");
+	if(writer.file == 0){
+		return hashTable_errorIo;
+	}
+	setvbuf(writer.file, 0, _IOFBF, HASHTABLELOG_BUFFER_SIZE);
+	writer.check = CHECKSUM_SEED;
+	writer.blobs = (ht->flags & hashTable_flagBlobValues) != 0;
+	fwrite(writer.blobs ? SNAP_BLOB_MAGIC : SNAP_MAGIC, 1, MAGIC_SIZE,
+		writer.file);
+	HASHTABLE_TRAVERSAL(ht, writeSnapshotNode, &writer);
+	writer.check = checksum(writer.check, &end, 1);
+	fwrite(&end, 1, 1, writer.file);
+	fwrite(&writer.check, 1, 4, writer.file);
+	failed = (fflush(writer.file) != 0) || (fsync(fileno(writer.file)) != 0);
+	failed |= (fclose(writer.file) != 0);
+	if(failed || rename(tmpPath, snapPath)){
+		unlink(tmpPath);
+		return hashTable_errorIo;
+	}
+	syncDirectory(snapPath);
+	return hashTable_OK;
+}
+
+/*******************************************************************************
+ * Section Background Threads
+*******************************************************************************/
+
+// fsync pending records every syncMicros
+static void *
+flusherThread(void *arg)
+{
+	HashTableLog *log = arg;
+	struct timespec deadline;
+	u8 needSync;
+
+	pthread_mutex_lock(&log->lock);
+	while(!log->stop){
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += (log->syncMicros % 1000000) * 1000;
+		deadline.tv_sec  += log->syncMicros / 1000000
+		                  + deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&log->wake, &log->lock, &deadline);
+		needSync = (log->pendingOps != 0);
+		if(needSync){
+			flushLocked(log);
+			log->pendingOps = 0;
+		}
+		pthread_mutex_unlock(&log->lock);
+		if(needSync){
+			syncFile(log);
+		}
+		pthread_mutex_lock(&log->lock);
+	}
+	pthread_mutex_unlock(&log->lock);
+	return 0;
+}
+
+// caller holds log->lock, after a failure wait for another compactBytes of
+// records before trying again
+static void
+backOff(HashTableLog *log, s32 returnCode)
+{
+	if(log->compactBytes == 0){
+		return;
+	}
+	log->compactAt = log->compactBytes;
+	if(returnCode){
+		log->compactAt += log->logBytes+log->bufLen;
+	}
+}
+
+// Seal the active log as <path>.old and switch to a fresh one. The new file is
+// written and synced before log->lock is taken, the table thread only waits
+// for the buffer flush and two renames.
+static s32
+sealLog(HashTableLog *log)
+{
+	s32 fd, oldFd, returnCode = hashTable_OK;
+	fd = open(log->newPath, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644);
+	if( (fd < 0) || writeAll(fd, (u8*)LOG_MAGIC, MAGIC_SIZE) || fdatasync(fd) ){
+		if(fd >= 0){
+			close(fd);
+		}
+		unlink(log->newPath);
+		return hashTable_errorIo;
+	}
+	// a sync must not return before the sealed records are durable
+	pthread_mutex_lock(&log->syncLock);
+	pthread_mutex_lock(&log->lock);
+	flushLocked(log);
+	log->pendingOps = 0;
+	oldFd = log->fd;
+	if(rename(log->path, log->oldPath)){
+		returnCode = hashTable_errorIo;
+	} else if(rename(log->newPath, log->path)){
+		// keep appending to the sealed file, nothing is lost
+		rename(log->oldPath, log->path);
+		returnCode = hashTable_errorIo;
+	} else {
+		log->fd = fd;
+		log->logBytes = MAGIC_SIZE;
+	}
+	pthread_mutex_unlock(&log->lock);
+	if(returnCode){
+		close(fd);
+		unlink(log->newPath);
+	} else {
+		if(fdatasync(oldFd)){
+			returnCode = hashTable_errorIo;
+		}
+		close(oldFd);
+		syncDirectory(log->path);
+	}
+	pthread_mutex_unlock(&log->syncLock);
+	return returnCode;
+}
+
+// Seal the active log, unless an earlier fold failed or was interrupted, then
+// fold the sealed log in to the snapshot using a private table.
+static void *
+compactorThread(void *arg)
+{
+	HashTableLog *log = arg;
+	HashTable *ht;
+	s32 returnCode = hashTable_OK;
+
+	if(access(log->oldPath, F_OK) != 0){
+		returnCode = sealLog(log);
+	}
+	if(returnCode == hashTable_OK){
+		returnCode = hashTable_initWithFlags(&ht,
+			log->blobs ? hashTable_flagBlobValues : 0);
+	}
+	if(returnCode == hashTable_OK){
+		returnCode = loadSnapshot(ht, log->snapPath);
+		if(returnCode == hashTable_OK){
+			returnCode = replayLog(ht, log->oldPath, 0);
+		}
+		if(returnCode == hashTable_OK){
+			returnCode = writeSnapshot(ht, log->tmpPath, log->snapPath);
+		}
+		if(returnCode == hashTable_OK){
+			unlink(log->oldPath);
+			syncDirectory(log->oldPath);
+		}
+		hashTable_freeAll(&ht);
+	}
+	pthread_mutex_lock(&log->lock);
+	if(returnCode){
+		setError(log, returnCode);
+	}
+	backOff(log, returnCode);
+	log->compactState = compactFinished;
+	pthread_mutex_unlock(&log->lock);
+	return 0;
+}
+
+static s32
+startCompactor(HashTableLog *log)
+{
+	pthread_mutex_lock(&log->lock);
+	log->compactState = compactRunning;
+	pthread_mutex_unlock(&log->lock);
+	if(pthread_create(&log->compactor, 0, compactorThread, log)){
+		pthread_mutex_lock(&log->lock);
+		log->compactState = compactIdle;
+		backOff(log, hashTable_errorIo);
+		pthread_mutex_unlock(&log->lock);
+		return hashTable_errorIo;
+	}
+	return hashTable_OK;
+}
+
+// join a finished compactor, returns non zero while one is still running
+static s32
+reapCompactor(HashTableLog *log, u8 wait)
+{
+	u8 state;
+	pthread_mutex_lock(&log->lock);
+	state = log->compactState;
+	pthread_mutex_unlock(&log->lock);
+	if( (state == compactIdle) || ((state == compactRunning) && !wait) ){
+		return state;
+	}
+	pthread_join(log->compactor, 0);
+	log->compactState = compactIdle;
+	return compactIdle;
+}
+
+/*******************************************************************************
+ * Section Hook
+*******************************************************************************/
+
+static void
+logHook(void *ctx, u32 op, u8 *key, u8 keyLen, HtValue value)
+{
+	HashTableLog *log = ctx;
+	u8 head[RECORD_MAX];
+	u8 *record, *blob = 0;
+	u32 len = RECORD_HEADER+keyLen+sizeof(HtValue), blobLen = 0, check;
+	u8 needSync = 0, needCompact;
+	if( (op != hashTable_opInsert) && (op != hashTable_opDelete) ){
+		return;
+	}
+	if( (op == hashTable_opInsert) && log->blobs ){
+		blob = hashTable_nodeBlob(HASHTABLE_KEY_NODE(key), &blobLen);
+		op = OP_INSERT_BLOB;
+		len += 4;
+	}
+	pthread_mutex_lock(&log->lock);
+	if(log->bufLen+len+blobLen > HASHTABLELOG_BUFFER_SIZE){
+		flushLocked(log);
+	}
+	// a record larger than the buffer goes straight to the file
+	record = (len+blobLen <= HASHTABLELOG_BUFFER_SIZE)
+		? log->buf+log->bufLen : head;
+	record[4] = op;
+	record[5] = keyLen;
+	memcpy(record+RECORD_HEADER, key, keyLen);
+	memcpy(record+RECORD_HEADER+keyLen, &value, sizeof(HtValue));
+	if(blob){
+		memcpy(record+len-4, &blobLen, 4);
+	}
+	check = checksum(checksum(CHECKSUM_SEED, record+4, len-4), blob, blobLen);
+	memcpy(record, &check, 4);
+	if(record == head){
+		if(writeAll(log->fd, head, len) || writeAll(log->fd, blob, blobLen)){
+			setError(log, hashTable_errorIo);
+		}
+		log->logBytes += len+blobLen;
+	} else {
+		if(blobLen){
+			memcpy(record+len, blob, blobLen);
+		}
+		log->bufLen += len+blobLen;
+	}
+	log->pendingOps++;
+	if(log->pendingOps >= log->syncOps){
+		flushLocked(log);
+		log->pendingOps = 0;
+		needSync = 1;
+	}
+	// the seal and fold run on the compactor thread, never in the mutation
+	needCompact = log->compactAt && (log->compactState != compactRunning)
+		&& (log->logBytes+log->bufLen >= log->compactAt);
+	pthread_mutex_unlock(&log->lock);
+	if(needSync){
+		syncFile(log);
+	}
+	if(needCompact){
+		reapCompactor(log, 0);
+		startCompactor(log);
+	}
+}
+
+/*******************************************************************************
+ * Section Main Function API
+*******************************************************************************/
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableLog_recover(HashTable *ht, const char *path)
+{
+	hashTable_hookFn hook;
+	char *oldPath, *snapPath;
+	s32 returnCode;
+	if(ht==0){
+		return hashTable_errorNullParam1;
+	}
+	if(path==0){
+		return hashTable_errorNullParam2;
+	}
+	oldPath = makePath(path, ".old");
+	snapPath = makePath(path, ".snap");
+	if( (oldPath==0) || (snapPath==0) ){
+		HASHTABLE_FREE(oldPath);
+		HASHTABLE_FREE(snapPath);
+		return hashTable_errorMallocFailed;
+	}
+	// replaying must not log the records again
+	hook = ht->hook;
+	ht->hook = 0;
+	returnCode = loadSnapshot(ht, snapPath);
+	if(returnCode == hashTable_OK){
+		returnCode = replayLog(ht, oldPath, 0);
+	}
+	if(returnCode == hashTable_OK){
+		returnCode = replayLog(ht, path, 1);
+	}
+	ht->hook = hook;
+	HASHTABLE_FREE(oldPath);
+	HASHTABLE_FREE(snapPath);
+	return returnCode;
+}
+
+static void
+freeLog(HashTableLog *log)
+{
+	HASHTABLE_FREE(log->path);
+	HASHTABLE_FREE(log->oldPath);
+	HASHTABLE_FREE(log->snapPath);
+	HASHTABLE_FREE(log->tmpPath);
+	HASHTABLE_FREE(log->newPath);
+	HASHTABLE_FREE(log->buf);
+	HASHTABLE_FREE(log);
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableLog_open(
+	HashTableLog **log_p,
+	HashTable    *ht,
+	const char   *path,
+	u32          syncOps,
+	u32          syncMicros,
+	u64          compactBytes)
+{
+	HashTableLog *log;
+	struct stat info;
+	s32 returnCode;
+	if(log_p==0){
+		return hashTable_errorNullParam1;
+	}
+	if(ht==0){
+		return hashTable_errorNullParam2;
+	}
+	if(path==0){
+		return hashTable_errorNullParam3;
+	}
+	log = HASHTABLE_CALLOC(1, sizeof(HashTableLog));
+	if(log==0){
+		return hashTable_errorMallocFailed;
+	}
+	log->path = makePath(path, "");
+	log->oldPath = makePath(path, ".old");
+	log->snapPath = makePath(path, ".snap");
+	log->tmpPath = makePath(path, ".tmp");
+	log->newPath = makePath(path, ".new");
+	log->buf = HASHTABLE_MALLOC(HASHTABLELOG_BUFFER_SIZE);
+	if( (log->path==0) || (log->oldPath==0) || (log->snapPath==0)
+		|| (log->tmpPath==0) || (log->newPath==0) || (log->buf==0) ){
+		freeLog(log);
+		return hashTable_errorMallocFailed;
+	}
+	log->ht = ht;
+	log->syncOps = syncOps ? syncOps : DEFAULT_SYNC_OPS;
+	log->syncMicros = syncMicros;
+	log->compactBytes = compactBytes;
+	log->compactAt = compactBytes;
+	log->blobs = (ht->flags & hashTable_flagBlobValues) != 0;
+
+	returnCode = hashTableLog_recover(ht, path);
+	if(returnCode){
+		freeLog(log);
+		return returnCode;
+	}
+	log->fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+	if( (log->fd < 0) || fstat(log->fd, &info) ){
+		freeLog(log);
+		return hashTable_errorIo;
+	}
+	log->logBytes = info.st_size;
+	if(log->logBytes == 0){
+		if(writeAll(log->fd, (u8*)LOG_MAGIC, MAGIC_SIZE) || fdatasync(log->fd)){
+			close(log->fd);
+			freeLog(log);
+			return hashTable_errorIo;
+		}
+		syncDirectory(path);
+		log->logBytes = MAGIC_SIZE;
+	}
+	pthread_mutex_init(&log->lock, 0);
+	pthread_mutex_init(&log->syncLock, 0);
+	pthread_cond_init(&log->wake, 0);
+	if(syncMicros){
+		log->hasFlusher = (pthread_create(&log->flusher, 0, flusherThread, log)
+			== 0);
+	}
+	// a compaction was interrupted, finish folding the sealed log
+	if(access(log->oldPath, F_OK) == 0){
+		startCompactor(log);
+	}
+	hashTable_setHook(ht, logHook, log);
+	*log_p = log;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableLog_sync(HashTableLog *log)
+{
+	s32 returnCode;
+	if(log==0){
+		return hashTable_errorNullParam1;
+	}
+	pthread_mutex_lock(&log->lock);
+	flushLocked(log);
+	log->pendingOps = 0;
+	pthread_mutex_unlock(&log->lock);
+	syncFile(log);
+	pthread_mutex_lock(&log->lock);
+	returnCode = log->error;
+	pthread_mutex_unlock(&log->lock);
+	return returnCode;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableLog_compact(HashTableLog *log)
+{
+	if(log==0){
+		return hashTable_errorNullParam1;
+	}
+	if(reapCompactor(log, 0) != compactIdle){
+		// previous sealed log is still being folded in
+		return hashTable_OK;
+	}
+	return startCompactor(log);
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableLog_close(HashTableLog **log_p)
+{
+	HashTableLog *log;
+	s32 returnCode;
+	if( (log_p==0) || (*log_p==0) ){
+		return hashTable_errorNullParam1;
+	}
+	log = *log_p;
+	*log_p = 0;
+	hashTable_setHook(log->ht, 0, 0);
+	returnCode = hashTableLog_sync(log);
+	if(log->hasFlusher){
+		pthread_mutex_lock(&log->lock);
+		log->stop = 1;
+		pthread_cond_signal(&log->wake);
+		pthread_mutex_unlock(&log->lock);
+		pthread_join(log->flusher, 0);
+	}
+	reapCompactor(log, 1);
+	if(returnCode == hashTable_OK){
+		returnCode = log->error;
+	}
+	close(log->fd);
+	pthread_mutex_destroy(&log->lock);
+	pthread_mutex_destroy(&log->syncLock);
+	pthread_cond_destroy(&log->wake);
+	freeLog(log);
+	return returnCode;
+}
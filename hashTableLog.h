@@ -0,0 +1,74 @@
+/* hashTableLog.h */
+
+#ifndef HASHTABLELOG_HEADER
+#define HASHTABLELOG_HEADER
+#include "hashTable.h"
+
+/*******************************************************************************
+ * Write ahead log for a HashTable
+ *
+ * Every insert, update and delete is appended to <path> through the table
+ * hook. Records are buffered and written with one write() per buffer, fsync is
+ * batched: it runs once syncOps records are pending or syncMicros have passed,
+ * whichever comes first (group commit). A mutation can therefore be lost if
+ * the process dies before its batch is synced, call hashTableLog_sync when a
+ * caller needs a durability barrier. On a hashTable_flagBlobValues table every
+ * insert record also carries the blob of the key.
+ *
+ * Files:
+ * <path>      - active log
+ * <path>.old  - sealed log being folded into the snapshot
+ * <path>.snap - snapshot, replaced atomically by compaction
+ * <path>.new  - next active log, prepared while sealing
+ *
+ * Compaction seals the active log and folds it into the snapshot on a
+ * background thread. It only reads files, so the table keeps mutating, and a
+ * mutation never waits for its syncs or renames. Errors are reported by
+ * hashTableLog_sync and hashTableLog_close, a failed compaction is retried
+ * after another compactBytes of records.
+ *
+ * The log is not thread safe beyond its own background threads: mutate the
+ * table and call the functions below from one thread.
+*******************************************************************************/
+
+#ifndef HASHTABLELOG_BUFFER_SIZE
+#define HASHTABLELOG_BUFFER_SIZE (64*1024)
+#endif
+
+typedef struct HashTableLog HashTableLog;
+
+// Recover ht from the snapshot and logs at path, then attach the log to ht.
+// ht should be empty. compactBytes is the active log size that starts a
+// background compaction, 0 means only compact on hashTableLog_compact.
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableLog_open(
+	HashTableLog **log_p,       // address to write pointer to the new log
+	HashTable    *ht,           // table to recover in to and log from
+	const char   *path,         // path of the active log file
+	uint32_t     syncOps,       // fsync after this many records, 0 = 1024
+	uint32_t     syncMicros,    // fsync pending records after this long
+	uint64_t     compactBytes); // auto compaction threshold, 0 = manual
+
+// write out buffered records and fsync them before returning
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableLog_sync(HashTableLog *log);
+
+// seal the active log and fold it in to the snapshot in the background
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableLog_compact(HashTableLog *log);
+
+// sync, wait for compaction, detach from the table and free the log
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableLog_close(HashTableLog **log_p);
+
+// Apply the snapshot and logs at path to ht without attaching to it.
+// Used by hashTableLog_open, offered for read only recovery.
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableLog_recover(HashTable *ht, const char *path);
+
+#endif
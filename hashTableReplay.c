@@ -0,0 +1,322 @@
+/* hashTableReplay.c */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "hashTableTrace.h"
+
+typedef uint8_t  u8;
+typedef int8_t   s8;
+typedef uint32_t u32;
+typedef int32_t  s32;
+typedef uint64_t u64;
+typedef int64_t  s64;
+typedef double   f64;
+
+// ops in the report: insert, delete, find hit, find miss
+#define REPORT_OPS (4)
+
+typedef struct Op {
+	u64     nanos;
+	HtValue value;
+	u64     keyOffset;
+	u8      op;
+	u8      keyLen;
+} Op;
+
+typedef struct Trace {
+	Op  *ops;
+	u8  *keys;
+	u64 count;
+	u64 keyBytes;
+} Trace;
+
+enum {
+	tableNode,
+	tableCompact,
+	tableDense
+};
+
+typedef struct Config {
+	const char *path;
+	u32        flags;     // hashTable_initWithFlags flags for the node table
+	u32        repeat;
+	u8         table;
+	u8         timed;     // keep the recorded gaps between operations
+} Config;
+
+static u64
+nowNanos(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (u64)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+static s32
+loadTrace(const char *path, Trace *trace)
+{
+	HashTableTraceReader *reader;
+	HashTableTraceRecord record;
+	u64 opCap = 1024, keyCap = 64*1024;
+	s32 returnCode;
+	void *grown;
+	returnCode = hashTableTrace_openReader(&reader, path);
+	if(returnCode){
+		return returnCode;
+	}
+	trace->count = trace->keyBytes = 0;
+	trace->ops = malloc(opCap*sizeof(Op));
+	trace->keys = malloc(keyCap);
+	while(trace->ops && trace->keys
+		&& ((returnCode = hashTableTrace_next(reader, &record))
+			== hashTable_OK)){
+		if(trace->count == opCap){
+			opCap *= 2;
+			grown = realloc(trace->ops, opCap*sizeof(Op));
+			if(grown==0){
+				break;
+			}
+			trace->ops = grown;
+		}
+		if(trace->keyBytes+record.keyLen > keyCap){
+			keyCap *= 2;
+			grown = realloc(trace->keys, keyCap);
+			if(grown==0){
+				break;
+			}
+			trace->keys = grown;
+		}
+		trace->ops[trace->count].nanos = record.nanos;
+		trace->ops[trace->count].value = record.value;
+		trace->ops[trace->count].keyOffset = trace->keyBytes;
+		trace->ops[trace->count].op = record.op;
+		trace->ops[trace->count].keyLen = record.keyLen;
+		memcpy(trace->keys+trace->keyBytes, record.key, record.keyLen);
+		trace->keyBytes += record.keyLen;
+		trace->count++;
+	}
+	hashTableTrace_closeReader(&reader);
+	if(returnCode == hashTable_errorCorrupt){
+		// a trace cut short by a crash is still worth replaying
+		fprintf(stderr, "trace ends inside a record, replaying %lu ops\n",
+			trace->count);
+		returnCode = hashTable_nothingFound;
+	}
+	if(returnCode == hashTable_nothingFound){
+		return hashTable_OK;
+	}
+	free(trace->ops);
+	free(trace->keys);
+	trace->ops = 0;
+	trace->keys = 0;
+	return (returnCode == hashTable_OK) ? hashTable_errorMallocFailed
+		: returnCode;
+}
+
+static s32
+compareU32(const void *a, const void *b)
+{
+	u32 x = *(const u32*)a, y = *(const u32*)b;
+	return (x > y) - (x < y);
+}
+
+static void
+report(const char *name, u32 *latencies, u64 count)
+{
+	if(count == 0){
+		return;
+	}
+	qsort(latencies, count, sizeof(u32), compareU32);
+	printf("%-10s %10lu ops  p50 %6u  p90 %6u  p99 %6u  p99.9 %7u  max %8u ns\n",
+		name, count,
+		latencies[count/2],
+		latencies[count*9/10],
+		latencies[count*99/100],
+		latencies[count*999/1000],
+		latencies[count-1]);
+}
+
+static s32
+replay(Config *config, Trace *trace, u32 *latencies[REPORT_OPS],
+	u64 counts[REPORT_OPS], u64 *elapsed, u64 *maxLag)
+{
+	HashTable *ht = 0;
+	HashTableCompact *ct = 0;
+	HashTableDense *dt = 0;
+	hashTableNode *node;
+	HtValue value;
+	Op *op;
+	u8 *key;
+	u64 start, before, due, x;
+	u32 kind;
+	s32 returnCode = 0;
+	if(config->table == tableCompact){
+		returnCode = hashTable_initCompact(&ct);
+	} else if(config->table == tableDense){
+		returnCode = hashTable_initDense(&dt);
+	} else {
+		returnCode = hashTable_initWithFlags(&ht, config->flags);
+	}
+	if(returnCode){
+		return returnCode;
+	}
+	*maxLag = 0;
+	start = nowNanos();
+	for(x = 0; x < trace->count; x++){
+		op = &trace->ops[x];
+		key = trace->keys+op->keyOffset;
+		if(config->timed){
+			due = start+op->nanos;
+			while((before = nowNanos()) < due){
+				if(due-before > 200000){
+					struct timespec gap = {0, (due-before-100000)};
+					nanosleep(&gap, 0);
+				}
+			}
+			if(before-due > *maxLag){
+				*maxLag = before-due;
+			}
+		} else {
+			before = nowNanos();
+		}
+		if(op->op == hashTable_opInsert){
+			kind = 0;
+			if(ht){
+				returnCode = hashTable_insert(ht, key, op->keyLen, op->value);
+			} else if(ct){
+				returnCode = hashTable_insertCompact(ct, key, op->keyLen,
+					op->value);
+			} else {
+				returnCode = hashTable_insertDense(dt, key, op->keyLen,
+					op->value);
+			}
+		} else if(op->op == hashTable_opDelete){
+			kind = 1;
+			if(ht){
+				returnCode = hashTable_delete(ht, key, op->keyLen, &value);
+			} else if(ct){
+				returnCode = hashTable_deleteCompact(ct, key, op->keyLen, &value);
+			} else {
+				returnCode = hashTable_deleteDense(dt, key, op->keyLen, &value);
+			}
+		} else {
+			if(ht){
+				returnCode = hashTable_find(ht, key, op->keyLen, &node);
+			} else if(ct){
+				returnCode = hashTable_findCompact(ct, key, op->keyLen, &value);
+			} else {
+				returnCode = hashTable_findDense(dt, key, op->keyLen, &value);
+			}
+			kind = (returnCode == hashTable_OK) ? 2 : 3;
+		}
+		latencies[kind][counts[kind]++] = nowNanos()-before;
+		if(returnCode < 0){
+			fprintf(stderr, "op %lu failed: %s\n", x,
+				hashTable_debugString(returnCode));
+			break;
+		}
+		returnCode = 0;
+	}
+	*elapsed = nowNanos()-start;
+	if(ht){
+		hashTable_freeAll(&ht);
+	} else if(ct){
+		hashTable_freeCompact(&ct);
+	} else {
+		hashTable_freeDense(&dt);
+	}
+	return returnCode;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: hashTableReplay [options] trace\n"
+		"  -timed       keep the recorded time between operations\n"
+		"  -repeat n    replay the trace n times, default 1\n"
+		"  -table name  node (default), compact or dense\n"
+		"  -hardened    node table with hashTable_flagHardened\n"
+		"  -huge        node table with hashTable_flagHugePages\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const char *names[REPORT_OPS] = {
+		"insert", "delete", "find hit", "find miss"};
+	Config config = {0, 0, 1, tableNode, 0};
+	Trace trace;
+	u32 *latencies[REPORT_OPS] = {0};
+	u64 counts[REPORT_OPS], elapsed, maxLag;
+	s32 x, kind, returnCode = 1;
+	for(x = 1; x < argc; x++){
+		if(strcmp(argv[x], "-timed") == 0){
+			config.timed = 1;
+		} else if( (strcmp(argv[x], "-repeat") == 0) && (x+1 < argc) ){
+			config.repeat = strtoul(argv[++x], 0, 10);
+		} else if( (strcmp(argv[x], "-table") == 0) && (x+1 < argc) ){
+			x++;
+			if(strcmp(argv[x], "compact") == 0){
+				config.table = tableCompact;
+			} else if(strcmp(argv[x], "dense") == 0){
+				config.table = tableDense;
+			} else if(strcmp(argv[x], "node") != 0){
+				usage();
+				return 1;
+			}
+		} else if(strcmp(argv[x], "-hardened") == 0){
+			config.flags |= hashTable_flagHardened;
+		} else if(strcmp(argv[x], "-huge") == 0){
+			config.flags |= hashTable_flagHugePages;
+		} else if( (argv[x][0] != '-') && (config.path == 0) ){
+			config.path = argv[x];
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if(config.path == 0){
+		usage();
+		return 1;
+	}
+	if(loadTrace(config.path, &trace)){
+		fprintf(stderr, "cannot load trace %s\n", config.path);
+		return 1;
+	}
+	for(kind = 0; kind < REPORT_OPS; kind++){
+		latencies[kind] = malloc((trace.count+1)*sizeof(u32));
+		if(latencies[kind] == 0){
+			fprintf(stderr, "out of memory\n");
+			goto DONE;
+		}
+	}
+	printf("%lu ops, %lu key bytes, recorded over %.3f s\n", trace.count,
+		trace.keyBytes,
+		trace.count ? trace.ops[trace.count-1].nanos*1e-9 : 0.0);
+	for(u32 run = 0; run < config.repeat; run++){
+		for(kind = 0; kind < REPORT_OPS; kind++){
+			counts[kind] = 0;
+		}
+		if(replay(&config, &trace, latencies, counts, &elapsed, &maxLag)){
+			goto DONE;
+		}
+		printf("run %u: %.3f s, %.0f ops/s", run+1, elapsed*1e-9,
+			elapsed ? trace.count/(elapsed*1e-9) : 0.0);
+		if(config.timed){
+			printf(", max lag behind schedule %lu ns", maxLag);
+		}
+		printf("\n");
+		for(kind = 0; kind < REPORT_OPS; kind++){
+			report(names[kind], latencies[kind], counts[kind]);
+		}
+	}
+	returnCode = 0;
+	DONE:
+	for(kind = 0; kind < REPORT_OPS; kind++){
+		free(latencies[kind]);
+	}
+	free(trace.ops);
+	free(trace.keys);
+	return returnCode;
+}
@@ -0,0 +1,206 @@
+/* hashTableScale.c */
+
+// Fills one node table past 2^SCALE_LOG2 entries and checks that counting,
+// resizing and lookups stay correct once sizes and masks need more than 32
+// bits. The default of 32 needs about 250GB, build with a smaller SCALE_LOG2
+// on smaller machines: make scale SCALE_LOG2=24
+//
+// hashTable.c is built in to this file so nodes can come from a bump arena:
+// no malloc header per node, about 48 bytes per entry with the bucket array.
+
+#define HASHTABLE_CUSTOM_ALLOC
+#define HASHTABLE_STATIC_BUILD_IN
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+
+static void *scaleMalloc(size_t bytes);
+static void scaleFree(void *ptr);
+
+#define HASHTABLE_FREE    scaleFree
+#define HASHTABLE_MALLOC  scaleMalloc
+#define HASHTABLE_CALLOC  calloc
+#define HASHTABLE_REALLOC realloc
+
+#include "hashTable.c"
+
+#ifndef SCALE_LOG2
+#define SCALE_LOG2 (32)
+#endif
+
+// a sixteenth past the power of 2, so the table grows to 2^(SCALE_LOG2+1)
+#define SCALE_ENTRIES (((u64)1<<SCALE_LOG2) + ((u64)1<<(SCALE_LOG2-4)))
+// misses looked up after the fill
+#define SCALE_MISSES  (SCALE_ENTRIES/16)
+
+typedef double f64;
+
+typedef struct Arena {
+	u8  *base;
+	u64 used;
+	u64 bytes;
+} Arena;
+
+static Arena arena;
+
+// Nodes are handed out in order and never reused, freed nodes stay in the
+// arena. Anything that does not fit, such as bucket arrays, goes to malloc.
+static void *
+scaleMalloc(size_t bytes)
+{
+	void *ptr;
+	bytes = (bytes+7)/8*8;
+	if( (bytes > 256) || (arena.used+bytes > arena.bytes) ){
+		return malloc(bytes);
+	}
+	ptr = arena.base+arena.used;
+	arena.used += bytes;
+	return ptr;
+}
+
+static void
+scaleFree(void *ptr)
+{
+	if( ((u8*)ptr < arena.base) || ((u8*)ptr >= arena.base+arena.bytes) ){
+		free(ptr);
+	}
+}
+
+static f64
+secondsSince(struct timespec *start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec-start->tv_sec) + (end.tv_nsec-start->tv_nsec)*1e-9;
+}
+
+static void
+report(const char *phase, u64 ops, struct timespec *start)
+{
+	f64 seconds = secondsSince(start);
+	printf("%-8s %12lu ops %9.2f s %7.1f ns/op\n", phase, ops, seconds,
+		ops ? seconds*1e9/ops : 0.0);
+}
+
+// nodes whose bucket is in the upper half of the table, only there if the
+// top bit of the mask is used
+static u64
+upperHalfNodes(HashTable *ht)
+{
+	hashTableNode *curNode;
+	u64 x, nodes = 0;
+	for(x = ht->size/2; x < ht->size; x++){
+		for(curNode = ht->table[x]; curNode; curNode = curNode->next){
+			nodes++;
+		}
+	}
+	return nodes;
+}
+
+int main(void)
+{
+	HashTable *ht;
+	HashTableStats stats;
+	hashTableNode *node;
+	struct timespec start;
+	HtValue value;
+	u64 x, expectSize, upper, peakSize, failures = 0;
+	arena.bytes = SCALE_ENTRIES*40 + (1<<20);
+	arena.base = mmap(0, arena.bytes, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if(arena.base == MAP_FAILED){
+		arena.base = 0;
+		arena.bytes = 0;
+	}
+	printf("scale test, %lu entries (2^%d + 2^%d)\n", SCALE_ENTRIES, SCALE_LOG2,
+		SCALE_LOG2-4);
+	if(hashTable_init(&ht)){
+		printf("Strange init failure\n");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(x = 0; x < SCALE_ENTRIES; x++){
+		if(hashTable_insertIntKey(ht, x, x)){
+			printf("Strange insert failure at %lu\n", x);
+			return 1;
+		}
+	}
+	report("insert", SCALE_ENTRIES, &start);
+	hashTable_getStats(ht, &stats);
+	expectSize = (u64)1<<(SCALE_LOG2+1);
+	printf("count %lu size %lu resizes %u\n", stats.count, stats.size,
+		stats.resizes);
+	if( (stats.count != SCALE_ENTRIES) || (hashTable_getCount(ht) != SCALE_ENTRIES)
+		|| (stats.size != expectSize) ){
+		printf("Strange count or size, expected %lu and %lu\n", SCALE_ENTRIES,
+			expectSize);
+		failures++;
+	}
+	// with a truncated mask every node would sit in the lower half
+	upper = upperHalfNodes(ht);
+	printf("upper half of buckets holds %.1f%%\n", upper*100.0/SCALE_ENTRIES);
+	if( (upper < SCALE_ENTRIES*2/5) || (upper > SCALE_ENTRIES*3/5) ){
+		printf("Strange spread over the buckets\n");
+		failures++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(x = 0; x < SCALE_ENTRIES; x++){
+		if( hashTable_findIntKey(ht, x, &node) || (node->value != x) ){
+			printf("Strange failure to find %lu\n", x);
+			failures++;
+			break;
+		}
+	}
+	report("find", SCALE_ENTRIES, &start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(x = SCALE_ENTRIES; x < SCALE_ENTRIES+SCALE_MISSES; x++){
+		if(hashTable_findIntKey(ht, x, &node) == hashTable_OK){
+			printf("Strange find of missing %lu\n", x);
+			failures++;
+			break;
+		}
+	}
+	report("miss", SCALE_MISSES, &start);
+
+	// delete three of every four keys, enough to shrink the table once
+	peakSize = ht->size;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(x = 0; x < SCALE_ENTRIES; x++){
+		if( (x & 3) && (hashTable_deleteIntKey(ht, x, &value) || (value != x)) ){
+			printf("Strange failure to delete %lu\n", x);
+			failures++;
+			break;
+		}
+	}
+	report("delete", SCALE_ENTRIES/4*3, &start);
+	hashTable_getStats(ht, &stats);
+	printf("count %lu size %lu resizes %u\n", stats.count, stats.size,
+		stats.resizes);
+	if( (stats.count != (SCALE_ENTRIES+3)/4) || (stats.size != peakSize/2)
+		|| (hashTable_countEachNode(ht) != stats.count) ){
+		printf("Strange count or size after delete\n");
+		failures++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(x = 0; x < SCALE_ENTRIES; x++){
+		if( (hashTable_findIntKey(ht, x, &node) == hashTable_OK) != !(x & 3) ){
+			printf("Strange find result for %lu after delete\n", x);
+			failures++;
+			break;
+		}
+	}
+	report("find", SCALE_ENTRIES, &start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	hashTable_freeAll(&ht);
+	report("free", stats.count, &start);
+	printf("%s\n", failures ? "FAILED" : "passed");
+	return failures != 0;
+}
@@ -0,0 +1,574 @@
+/* hashTableShm.c */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hashTableShm.h"
+
+typedef uint8_t  u8;
+typedef int8_t   s8;
+typedef uint32_t u32;
+typedef int32_t  s32;
+typedef uint64_t u64;
+typedef int64_t  s64;
+
+#define SHM_MAGIC       "HTSHM001"
+#define SHM_ALIGN       (64)
+// next, value, hash, keyLen
+#define NODE_HEADER     (8+sizeof(HtValue)+8+1)
+// free lists by node size in 8 byte units
+#define SHM_CLASSES     ((NODE_HEADER+255+7)/8+1)
+// odd sequence spins before a reader checks for a dead writer
+#define SHM_SPINS       (1<<16)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() do{}while(0)
+#endif
+
+typedef struct ShmHeader {
+	u8              magic[8];
+	u64             bytes;
+	u64             seed;
+	u64             bucketsOffset;
+	u64             heapOffset;   // first node byte
+	u64             heapTop;      // next never used node byte
+	u64             count;
+	u64             sequence;     // odd while a writer is changing the table
+	u64             freeLists[SHM_CLASSES];
+	u32             bucketCount;  // power of 2
+	u32             ready;        // set last by create
+	pthread_mutex_t lock;         // process shared and robust
+} ShmHeader;
+
+// hashTableNode with offsets in place of pointers
+typedef struct ShmNode {
+	u64     next;
+	HtValue value;
+	u64     hash;
+	u8      keyLen;
+	u8      key[];
+} ShmNode;
+
+/*******************************************************************************
+ * Section Internal Functions
+*******************************************************************************/
+
+static inline ShmHeader *
+header(HashTableShm *shm)
+{
+	return (ShmHeader*)shm->base;
+}
+
+static inline u64 *
+buckets(HashTableShm *shm)
+{
+	return (u64*)(shm->base+header(shm)->bucketsOffset);
+}
+
+static inline u32
+nodeClass(u8 keyLen)
+{
+	return (NODE_HEADER+keyLen+7)/8;
+}
+
+// fnv-1a 64 with a final mix, every process must hash the same way so the
+// table does not use HT_HASH which can differ between builds
+static u64
+shmHash(u8 *key, u8 keyLen, u64 seed)
+{
+	u64 hash = seed;
+	u32 x;
+	for(x = 0; x < keyLen; x++){
+		hash = (hash ^ key[x]) * 0x100000001b3;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccd;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+// 0 when a node can not be read at offset without leaving the region
+static inline ShmNode *
+nodeAt(HashTableShm *shm, u64 offset)
+{
+	ShmNode *node;
+	if( (offset & 7) || (offset < header(shm)->heapOffset)
+		|| (offset > shm->bytes-NODE_HEADER) ){
+		return 0;
+	}
+	node = (ShmNode*)(shm->base+offset);
+	if(offset+NODE_HEADER+node->keyLen > shm->bytes){
+		return 0;
+	}
+	return node;
+}
+
+static inline s32
+keyEquals(ShmNode *node, u8 *key, u8 keyLen, u64 hash)
+{
+	u32 x;
+	if( (node->hash != hash) || (node->keyLen != keyLen) ){
+		return 0;
+	}
+	for(x = 0; x < keyLen; x++){
+		if(node->key[x] != key[x]){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Walk the chain of hash, *link_p is left at the link holding the match or
+// the final 0 link. hashTable_OK, nothingFound or errorCorrupt.
+static s32
+walkChain(
+	HashTableShm *shm,
+	u8           *key,
+	u8           keyLen,
+	u64          hash,
+	u64          **link_p,
+	ShmNode      **node_p)
+{
+	u64 *link = &buckets(shm)[hash & (header(shm)->bucketCount-1)];
+	u64 offset;
+	ShmNode *node;
+	u32 walked;
+	for(walked = 0; walked < HASHTABLESHM_MAX_WALK; walked++){
+		offset = __atomic_load_n(link, __ATOMIC_ACQUIRE);
+		if(offset == 0){
+			*link_p = link;
+			return hashTable_nothingFound;
+		}
+		node = nodeAt(shm, offset);
+		if(node == 0){
+			return hashTable_errorCorrupt;
+		}
+		if(keyEquals(node, key, keyLen, hash)){
+			*link_p = link;
+			*node_p = node;
+			return hashTable_OK;
+		}
+		link = &node->next;
+	}
+	return hashTable_errorCorrupt;
+}
+
+static s32
+shmLock(ShmHeader *head)
+{
+	s32 error = pthread_mutex_lock(&head->lock);
+	if(error == EOWNERDEAD){
+		// the last writer died, its links are whole, at most a node leaked
+		if(head->sequence & 1){
+			__atomic_store_n(&head->sequence, head->sequence+1,
+				__ATOMIC_RELEASE);
+		}
+		pthread_mutex_consistent(&head->lock);
+		return hashTable_OK;
+	}
+	return error ? hashTable_errorCorrupt : hashTable_OK;
+}
+
+static inline void
+writeBegin(ShmHeader *head)
+{
+	__atomic_store_n(&head->sequence, head->sequence+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+writeEnd(ShmHeader *head)
+{
+	__atomic_store_n(&head->sequence, head->sequence+1, __ATOMIC_RELEASE);
+}
+
+static u64
+allocNode(HashTableShm *shm, u8 keyLen)
+{
+	ShmHeader *head = header(shm);
+	u32 class = nodeClass(keyLen);
+	u64 offset = head->freeLists[class];
+	ShmNode *node;
+	if(offset){
+		node = nodeAt(shm, offset);
+		head->freeLists[class] = node ? node->next : 0;
+		return node ? offset : 0;
+	}
+	if(head->heapTop+class*8 > shm->bytes){
+		return 0;
+	}
+	offset = head->heapTop;
+	head->heapTop += class*8;
+	return offset;
+}
+
+static s32
+mapRegion(HashTableShm **shm_p, s32 fd, u64 bytes)
+{
+	HashTableShm *shm = HASHTABLE_MALLOC(sizeof(HashTableShm));
+	void *base;
+	if(shm==0){
+		close(fd);
+		return hashTable_errorMallocFailed;
+	}
+	base = mmap(0, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(base == MAP_FAILED){
+		close(fd);
+		HASHTABLE_FREE(shm);
+		return hashTable_errorIo;
+	}
+	shm->base = base;
+	shm->bytes = bytes;
+	shm->fd = fd;
+	*shm_p = shm;
+	return hashTable_OK;
+}
+
+/*******************************************************************************
+ * Section Setup
+*******************************************************************************/
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableShm_create(
+	HashTableShm **shm_p,
+	const char   *name,
+	u64          bytes,
+	u32          expected)
+{
+	HashTableShm *shm;
+	ShmHeader *head;
+	pthread_mutexattr_t attr;
+	struct timespec now;
+	u64 bucketCount = 8, bucketsOffset, heapOffset;
+	s32 fd, returnCode;
+	if(shm_p==0){
+		return hashTable_errorNullParam1;
+	}
+	if(name==0){
+		return hashTable_errorNullParam2;
+	}
+	while(bucketCount < expected){
+		bucketCount *= 2;
+	}
+	bucketsOffset = (sizeof(ShmHeader)+SHM_ALIGN-1) & ~(u64)(SHM_ALIGN-1);
+	heapOffset = (bucketsOffset+bucketCount*8+SHM_ALIGN-1)
+		& ~(u64)(SHM_ALIGN-1);
+	if( (bucketCount > 0x80000000) || (heapOffset >= bytes) ){
+		return hashTable_errorCannotMakeNewTable;
+	}
+	fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+	if(fd < 0){
+		return hashTable_errorIo;
+	}
+	// fresh pages read as zero, every bucket starts empty
+	if(ftruncate(fd, bytes)){
+		close(fd);
+		shm_unlink(name);
+		return hashTable_errorIo;
+	}
+	returnCode = mapRegion(&shm, fd, bytes);
+	if(returnCode){
+		shm_unlink(name);
+		return returnCode;
+	}
+	head = header(shm);
+	clock_gettime(CLOCK_REALTIME, &now);
+	head->bytes = bytes;
+	head->seed = 0xcbf29ce484222325 ^ ((u64)now.tv_sec*1000000000+now.tv_nsec);
+	head->bucketsOffset = bucketsOffset;
+	head->heapOffset = heapOffset;
+	head->heapTop = heapOffset;
+	head->bucketCount = bucketCount;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	returnCode = pthread_mutex_init(&head->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if(returnCode){
+		hashTableShm_detach(&shm);
+		shm_unlink(name);
+		return hashTable_errorIo;
+	}
+	memcpy(head->magic, SHM_MAGIC, 8);
+	__atomic_store_n(&head->ready, 1, __ATOMIC_RELEASE);
+	*shm_p = shm;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableShm_attach(HashTableShm **shm_p, const char *name)
+{
+	HashTableShm *shm;
+	ShmHeader *head;
+	struct stat info;
+	s32 fd, returnCode;
+	if(shm_p==0){
+		return hashTable_errorNullParam1;
+	}
+	if(name==0){
+		return hashTable_errorNullParam2;
+	}
+	fd = shm_open(name, O_RDWR, 0);
+	if(fd < 0){
+		return hashTable_errorIo;
+	}
+	if( fstat(fd, &info) || ((u64)info.st_size < sizeof(ShmHeader)) ){
+		close(fd);
+		return hashTable_errorCorrupt;
+	}
+	returnCode = mapRegion(&shm, fd, info.st_size);
+	if(returnCode){
+		return returnCode;
+	}
+	head = header(shm);
+	// the layout is trusted from here on, so check it fits the region
+	if( (__atomic_load_n(&head->ready, __ATOMIC_ACQUIRE) != 1)
+		|| memcmp(head->magic, SHM_MAGIC, 8)
+		|| (head->bytes != shm->bytes)
+		|| (head->bucketCount == 0)
+		|| (head->bucketCount & (head->bucketCount-1))
+		|| (head->bucketsOffset < sizeof(ShmHeader))
+		|| (head->bucketsOffset+(u64)head->bucketCount*8 > head->heapOffset)
+		|| (head->heapOffset > head->bytes) ){
+		hashTableShm_detach(&shm);
+		return hashTable_errorCorrupt;
+	}
+	*shm_p = shm;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+void
+hashTableShm_detach(HashTableShm **shm_p)
+{
+	HashTableShm *shm;
+	if( (shm_p==0) || (*shm_p==0) ){
+		return;
+	}
+	shm = *shm_p;
+	*shm_p = 0;
+	munmap(shm->base, shm->bytes);
+	close(shm->fd);
+	HASHTABLE_FREE(shm);
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableShm_unlink(const char *name)
+{
+	if(name==0){
+		return hashTable_errorNullParam1;
+	}
+	return shm_unlink(name) ? hashTable_errorIo : hashTable_OK;
+}
+
+/*******************************************************************************
+ * Section Main Function API
+*******************************************************************************/
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableShm_insert(
+	HashTableShm *shm,
+	u8           *key,
+	u8           keyLen,
+	HtValue      value)
+{
+	ShmHeader *head;
+	ShmNode *node;
+	u64 *link, hash, offset;
+	s32 returnCode;
+	if(shm==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	head = header(shm);
+	hash = shmHash(key, keyLen, head->seed);
+	returnCode = shmLock(head);
+	if(returnCode){
+		return returnCode;
+	}
+	returnCode = walkChain(shm, key, keyLen, hash, &link, &node);
+	if(returnCode == hashTable_OK){
+		writeBegin(head);
+		node->value = value;
+		writeEnd(head);
+		returnCode = hashTable_updatedValOfExistingKey;
+	} else if(returnCode == hashTable_nothingFound){
+		writeBegin(head);
+		offset = allocNode(shm, keyLen);
+		if(offset == 0){
+			returnCode = hashTable_errorMallocFailed;
+		} else {
+			node = (ShmNode*)(shm->base+offset);
+			node->next = 0;
+			node->value = value;
+			node->hash = hash;
+			node->keyLen = keyLen;
+			memcpy(node->key, key, keyLen);
+			// one store makes the node reachable
+			__atomic_store_n(link, offset, __ATOMIC_RELEASE);
+			head->count++;
+			returnCode = hashTable_OK;
+		}
+		writeEnd(head);
+	}
+	pthread_mutex_unlock(&head->lock);
+	return returnCode;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableShm_find(
+	HashTableShm *shm,
+	u8           *key,
+	u8           keyLen,
+	HtValue      *value)
+{
+	ShmHeader *head;
+	ShmNode *node;
+	u64 *link, hash, before;
+	HtValue found = 0;
+	u32 spins = 0;
+	s32 returnCode;
+	if(shm==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	if(value==0){
+		return hashTable_errorNullParam4;
+	}
+	head = header(shm);
+	hash = shmHash(key, keyLen, head->seed);
+	while(1){
+		before = __atomic_load_n(&head->sequence, __ATOMIC_ACQUIRE);
+		if(before & 1){
+			if(++spins == SHM_SPINS){
+				// a writer may have died mid change, locking repairs that
+				spins = 0;
+				if(shmLock(head) == hashTable_OK){
+					pthread_mutex_unlock(&head->lock);
+				}
+			}
+			CPU_RELAX();
+			continue;
+		}
+		returnCode = walkChain(shm, key, keyLen, hash, &link, &node);
+		if(returnCode == hashTable_OK){
+			found = node->value;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&head->sequence, __ATOMIC_RELAXED) == before){
+			break;
+		}
+	}
+	if(returnCode == hashTable_OK){
+		*value = found;
+	}
+	return returnCode;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableShm_delete(
+	HashTableShm *shm,
+	u8           *key,
+	u8           keyLen,
+	HtValue      *value)
+{
+	ShmHeader *head;
+	ShmNode *node;
+	u64 *link, hash, offset;
+	u32 class;
+	s32 returnCode;
+	if(shm==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	head = header(shm);
+	hash = shmHash(key, keyLen, head->seed);
+	returnCode = shmLock(head);
+	if(returnCode){
+		return returnCode;
+	}
+	returnCode = walkChain(shm, key, keyLen, hash, &link, &node);
+	if(returnCode == hashTable_OK){
+		if(value){
+			*value = node->value;
+		}
+		offset = *link;
+		class = nodeClass(node->keyLen);
+		writeBegin(head);
+		__atomic_store_n(link, node->next, __ATOMIC_RELEASE);
+		node->next = head->freeLists[class];
+		head->freeLists[class] = offset;
+		head->count--;
+		writeEnd(head);
+	}
+	pthread_mutex_unlock(&head->lock);
+	return returnCode;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableShm_insertAll(HashTableShm *shm, HashTable *ht)
+{
+	hashTableNode *curNode;
+	u64 x;
+	s32 returnCode;
+	if(shm==0){
+		return hashTable_errorNullParam1;
+	}
+	if(ht==0){
+		return hashTable_errorNullParam2;
+	}
+	for(x = 0; x < ht->size; x++){
+		for(curNode = ht->table[x]; curNode; curNode = curNode->next){
+			returnCode = hashTableShm_insert(shm, curNode->key,
+				curNode->keyLen, curNode->value);
+			if(returnCode < 0){
+				return returnCode;
+			}
+		}
+	}
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+u64
+hashTableShm_getCount(HashTableShm *shm)
+{
+	return __atomic_load_n(&header(shm)->count, __ATOMIC_RELAXED);
+}
+
+HASHTABLE_STATIC_BUILD
+u64
+hashTableShm_bytesUsed(HashTableShm *shm)
+{
+	return __atomic_load_n(&header(shm)->heapTop, __ATOMIC_RELAXED)
+		- header(shm)->heapOffset;
+}
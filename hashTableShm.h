@@ -0,0 +1,101 @@
+/* hashTableShm.h */
+
+#ifndef HASHTABLESHM_HEADER
+#define HASHTABLESHM_HEADER
+#include "hashTable.h"
+
+/*******************************************************************************
+ * Shared memory table
+ *
+ * The header, bucket array and nodes live in one shm_open region and link to
+ * each other by offsets from the start of the region, so every process can map
+ * it at a different address. Capacity is fixed when the region is created:
+ * the bucket array never resizes and nodes come from the region, an insert
+ * that does not fit returns hashTable_errorMallocFailed.
+ *
+ * Writers take a process shared robust mutex and bump a sequence counter
+ * around each change. Readers take no lock: they walk the chain, copy the
+ * value out and retry if the sequence moved (seqlock). Offsets are bounds
+ * checked and walks are capped, so a reader racing a writer can not fault or
+ * loop. A writer that dies inside a change leaks at most the node it was
+ * adding or removing, the next writer takes over the lock.
+*******************************************************************************/
+
+// longest chain a find walks before deciding the region is damaged
+#ifndef HASHTABLESHM_MAX_WALK
+#define HASHTABLESHM_MAX_WALK (4096)
+#endif
+
+typedef struct HashTableShm {
+	uint8_t  *base;   // where this process mapped the region
+	uint64_t bytes;   // size of the region
+	int32_t  fd;
+} HashTableShm;
+
+// Create the shm object name (see shm_open) of bytes size and lay out an empty
+// table in it with a bucket for every expected entry. Fails if name exists.
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableShm_create(
+	HashTableShm **shm_p,     // address to write pointer to the new handle
+	const char   *name,       // shm object name, "/something"
+	uint64_t     bytes,       // total region size
+	uint32_t     expected);   // expected entries, sizes the bucket array
+
+// map a region made by hashTableShm_create in another or the same process
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableShm_attach(HashTableShm **shm_p, const char *name);
+
+// unmap the region from this process, the table stays for other processes
+HASHTABLE_STATIC_BUILD
+void
+hashTableShm_detach(HashTableShm **shm_p);
+
+// remove the shm object name, mappings stay valid until detached
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableShm_unlink(const char *name);
+
+// same return values as hashTable_insert
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableShm_insert(
+	HashTableShm *shm,      // attached table
+	uint8_t      *key,      // pointer to string key
+	uint8_t      keyLen,    // length of key in bytes(not including null)
+	HtValue      value);    // value to be stored
+
+// The value is copied out, nodes are not returned as another process can
+// free them at any time. hashTable_errorCorrupt if the region is damaged.
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableShm_find(
+	HashTableShm *shm,      // attached table
+	uint8_t      *key,      // pointer to string key
+	uint8_t      keyLen,    // length of key in bytes(not including null)
+	HtValue      *value);   // address for found value to be written
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableShm_delete(
+	HashTableShm *shm,      // attached table
+	uint8_t      *key,      // pointer to string key
+	uint8_t      keyLen,    // length of key in bytes(not including null)
+	HtValue      *value);   // OPTIONAL: pointer to memory for value
+
+// insert every node of ht, for filling a region once before workers attach
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableShm_insertAll(HashTableShm *shm, HashTable *ht);
+
+HASHTABLE_STATIC_BUILD
+uint64_t
+hashTableShm_getCount(HashTableShm *shm);
+
+// bytes of the region handed out to nodes, freed nodes are reused first
+HASHTABLE_STATIC_BUILD
+uint64_t
+hashTableShm_bytesUsed(HashTableShm *shm);
+
+#endif
@@ -0,0 +1,372 @@
+/* hashTableSpill.c */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "hashTableSpill.h"
+
+typedef uint8_t  u8;
+typedef int8_t   s8;
+typedef uint32_t u32;
+typedef int32_t  s32;
+typedef uint64_t u64;
+typedef int64_t  s64;
+
+// keyLen, key, value
+#define RECORD_MAX (1+255+sizeof(HtValue))
+// stdio buffer used when reading a run file back
+#define READ_BUFFER_SIZE (1024*1024)
+// smallest run file buffer when the budget shrinks them
+#define MIN_BUFFER_SIZE  (4096)
+
+typedef struct Partition {
+	u8  *buf;
+	u32 bufLen;
+	s32 fd;      // -1 until the partition first spills
+} Partition;
+
+struct HashTableSpill {
+	HashTable *ht;
+	char      *prefix;
+	Partition *parts;
+	u64       budget;
+	u64       nodeBytes;    // estimated heap held by nodes of ht
+	u64       fixedBytes;   // run file buffers and this spill's own memory
+	u32       bufSize;      // run file buffer of one partition
+	u64       spilled;
+	u32       bits;
+	s32       error;        // first write error, reported by flush and close
+	u8        spilling;     // budget was reached, new keys go to run files
+};
+
+/*******************************************************************************
+ * Section Internal Functions
+*******************************************************************************/
+
+// fnv-1a 64 with a final mix so the high bits depend on every key byte
+static u64
+spillHash(u8 *key, u8 keyLen)
+{
+	u64 hash = 0xcbf29ce484222325;
+	u32 x;
+	for(x = 0; x < keyLen; x++){
+		hash = (hash ^ key[x]) * 0x100000001b3;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccd;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+// an allocation as a malloc chunk: an 8 byte header, 16 byte granules
+static inline u64
+chunkBytes(u64 bytes)
+{
+	return (bytes+8+15)/16*16;
+}
+
+static inline u64
+nodeEstimate(HashTable *ht, u8 keyLen, u32 blobLen)
+{
+	return chunkBytes(hashTable_nodeSize(ht, keyLen, blobLen));
+}
+
+// bucket array bytes, counting old and new array while a grow rehashes
+static inline u64
+tableEstimate(HashTable *ht)
+{
+	u64 bytes = ht->size*sizeof(hashTableNode*);
+	return (ht->count+1 > ht->size) ? bytes*3 : bytes;
+}
+
+static void
+partitionPath(HashTableSpill *spill, u32 partition, char *path)
+{
+	sprintf(path, "%s.%u", spill->prefix, partition);
+}
+
+static s32
+writeAll(s32 fd, u8 *data, u64 len)
+{
+	ssize_t written;
+	while(len){
+		written = write(fd, data, len);
+		if(written < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return hashTable_errorIo;
+		}
+		data += written;
+		len -= written;
+	}
+	return hashTable_OK;
+}
+
+static void
+flushPartition(HashTableSpill *spill, Partition *part)
+{
+	if( part->bufLen && writeAll(part->fd, part->buf, part->bufLen)
+		&& (spill->error == hashTable_OK) ){
+		spill->error = hashTable_errorIo;
+	}
+	part->bufLen = 0;
+}
+
+static s32
+spillRecord(HashTableSpill *spill, u8 *key, u8 keyLen, HtValue value)
+{
+	Partition *part = &spill->parts[spillHash(key, keyLen) >> (64-spill->bits)];
+	char path[4096+16];
+	u8 *record;
+	if(part->fd < 0){
+		part->buf = HASHTABLE_MALLOC(spill->bufSize);
+		if(part->buf==0){
+			return hashTable_errorMallocFailed;
+		}
+		partitionPath(spill, part-spill->parts, path);
+		part->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if(part->fd < 0){
+			HASHTABLE_FREE(part->buf);
+			part->buf = 0;
+			return hashTable_errorIo;
+		}
+	}
+	if(part->bufLen+RECORD_MAX > spill->bufSize){
+		flushPartition(spill, part);
+	}
+	record = part->buf+part->bufLen;
+	record[0] = keyLen;
+	memcpy(record+1, key, keyLen);
+	memcpy(record+1+keyLen, &value, sizeof(HtValue));
+	part->bufLen += 1+keyLen+sizeof(HtValue);
+	spill->spilled++;
+	return hashTable_spilled;
+}
+
+/*******************************************************************************
+ * Section Main Function API
+*******************************************************************************/
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableSpill_open(
+	HashTableSpill **spill_p,
+	HashTable      *ht,
+	const char     *prefix,
+	u64            budget,
+	u32            partitionBits)
+{
+	HashTableSpill *spill;
+	hashTableNode *curNode;
+	u64 bucket, bufSize;
+	u32 x, partitions, blobLen = 0;
+	if(spill_p==0){
+		return hashTable_errorNullParam1;
+	}
+	if(ht==0){
+		return hashTable_errorNullParam2;
+	}
+	if( (prefix==0) || (strlen(prefix) > 4096) ){
+		return hashTable_errorNullParam3;
+	}
+	if( (partitionBits==0) || (partitionBits > HASHTABLESPILL_MAX_BITS) ){
+		return hashTable_errorNullParam4;
+	}
+	partitions = 1u << partitionBits;
+	spill = HASHTABLE_CALLOC(1, sizeof(HashTableSpill));
+	if(spill==0){
+		return hashTable_errorMallocFailed;
+	}
+	spill->prefix = HASHTABLE_MALLOC(strlen(prefix)+1);
+	spill->parts = HASHTABLE_MALLOC(partitions*sizeof(Partition));
+	if( (spill->prefix==0) || (spill->parts==0) ){
+		HASHTABLE_FREE(spill->prefix);
+		HASHTABLE_FREE(spill->parts);
+		HASHTABLE_FREE(spill);
+		return hashTable_errorMallocFailed;
+	}
+	strcpy(spill->prefix, prefix);
+	for(x = 0; x < partitions; x++){
+		spill->parts[x].buf = 0;
+		spill->parts[x].bufLen = 0;
+		spill->parts[x].fd = -1;
+	}
+	// count what the table already holds against the budget
+	for(bucket = 0; bucket < ht->size; bucket++){
+		for(curNode = ht->table[bucket]; curNode; curNode = curNode->next){
+			if(ht->flags & hashTable_flagBlobValues){
+				hashTable_nodeBlob(curNode, &blobLen);
+			}
+			spill->nodeBytes += nodeEstimate(ht, curNode->keyLen, blobLen);
+		}
+	}
+	// every run file buffer is reserved out of the budget, together they
+	// take at most a quarter of it
+	bufSize = (budget/4) >> partitionBits;
+	if(bufSize > HASHTABLESPILL_BUFFER_SIZE){
+		bufSize = HASHTABLESPILL_BUFFER_SIZE;
+	}
+	if(bufSize < MIN_BUFFER_SIZE){
+		bufSize = MIN_BUFFER_SIZE;
+	}
+	spill->bufSize = bufSize/8*8;
+	spill->fixedBytes = (chunkBytes(spill->bufSize) << partitionBits)
+		+ chunkBytes(partitions*sizeof(Partition))
+		+ chunkBytes(sizeof(HashTableSpill)) + chunkBytes(strlen(prefix)+1);
+	spill->ht = ht;
+	spill->budget = budget;
+	spill->bits = partitionBits;
+	*spill_p = spill;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableSpill_insert(
+	HashTableSpill *spill,
+	u8             *key,
+	u8             keyLen,
+	HtValue        value)
+{
+	s32 returnCode;
+	if(spill==0){
+		return hashTable_errorNullParam1;
+	}
+	if(key==0){
+		return hashTable_errorNullParam2;
+	}
+	if(keyLen==0){
+		return hashTable_errorNullParam3;
+	}
+	if( !spill->spilling && (spill->nodeBytes+nodeEstimate(spill->ht, keyLen, 0)
+		+tableEstimate(spill->ht)+spill->fixedBytes > spill->budget) ){
+		spill->spilling = 1;
+	}
+	if(spill->spilling){
+		// only keys already resident may change the table now
+		returnCode = hashTable_update(spill->ht, key, keyLen, value);
+		if(returnCode == hashTable_nothingFound){
+			return spillRecord(spill, key, keyLen, value);
+		}
+		return returnCode;
+	}
+	returnCode = hashTable_insert(spill->ht, key, keyLen, value);
+	if(returnCode == hashTable_OK){
+		spill->nodeBytes += nodeEstimate(spill->ht, keyLen, 0);
+	}
+	return returnCode;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableSpill_flush(HashTableSpill *spill)
+{
+	u32 x;
+	if(spill==0){
+		return hashTable_errorNullParam1;
+	}
+	for(x = 0; x < (1u << spill->bits); x++){
+		if(spill->parts[x].fd >= 0){
+			flushPartition(spill, &spill->parts[x]);
+		}
+	}
+	return spill->error;
+}
+
+HASHTABLE_STATIC_BUILD
+u32
+hashTableSpill_partitionCount(HashTableSpill *spill)
+{
+	return 1u << spill->bits;
+}
+
+HASHTABLE_STATIC_BUILD
+u64
+hashTableSpill_spilledCount(HashTableSpill *spill)
+{
+	return spill->spilled;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableSpill_loadPartition(
+	HashTableSpill *spill,
+	u32            partition,
+	HashTable      *ht)
+{
+	char path[4096+16];
+	u8 key[255];
+	s32 keyLen;
+	HtValue value;
+	FILE *file;
+	s32 returnCode;
+	if(spill==0){
+		return hashTable_errorNullParam1;
+	}
+	if(partition >= (1u << spill->bits)){
+		return hashTable_errorNullParam2;
+	}
+	if(ht==0){
+		return hashTable_errorNullParam3;
+	}
+	if(spill->parts[partition].fd < 0){
+		// nothing spilled here
+		return hashTable_OK;
+	}
+	flushPartition(spill, &spill->parts[partition]);
+	if(spill->error){
+		return spill->error;
+	}
+	partitionPath(spill, partition, path);
+	file = fopen(path, "rb");
+	if(file==0){
+		return hashTable_errorIo;
+	}
+	setvbuf(file, 0, _IOFBF, READ_BUFFER_SIZE);
+	returnCode = hashTable_OK;
+	while( (keyLen = getc(file)) != EOF ){
+		if( (keyLen == 0)
+			|| (fread(key, 1, keyLen, file) != (u32)keyLen)
+			|| (fread(&value, 1, sizeof(HtValue), file) != sizeof(HtValue)) ){
+			returnCode = hashTable_errorCorrupt;
+			break;
+		}
+		if(hashTable_insert(ht, key, keyLen, value) == hashTable_errorMallocFailed){
+			returnCode = hashTable_errorMallocFailed;
+			break;
+		}
+	}
+	fclose(file);
+	return returnCode;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableSpill_close(HashTableSpill **spill_p)
+{
+	HashTableSpill *spill;
+	char path[4096+16];
+	s32 returnCode;
+	u32 x;
+	if( (spill_p==0) || (*spill_p==0) ){
+		return hashTable_errorNullParam1;
+	}
+	spill = *spill_p;
+	*spill_p = 0;
+	returnCode = spill->error;
+	for(x = 0; x < (1u << spill->bits); x++){
+		if(spill->parts[x].fd >= 0){
+			close(spill->parts[x].fd);
+			partitionPath(spill, x, path);
+			unlink(path);
+			HASHTABLE_FREE(spill->parts[x].buf);
+		}
+	}
+	HASHTABLE_FREE(spill->parts);
+	HASHTABLE_FREE(spill->prefix);
+	HASHTABLE_FREE(spill);
+	return returnCode;
+}
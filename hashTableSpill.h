@@ -0,0 +1,88 @@
+/* hashTableSpill.h */
+
+#ifndef HASHTABLESPILL_HEADER
+#define HASHTABLESPILL_HEADER
+#include "hashTable.h"
+
+/*******************************************************************************
+ * Spilling inserts for key sets larger than memory
+ *
+ * Inserts go to the table until its estimated size (nodes as sized by
+ * hashTable_nodeSize, malloc overhead and bucket array, including the array
+ * the next resize would allocate) reaches the budget. After that a key already
+ * in the table is still updated in place through hashTable_update, so the
+ * table hook sees an insert and never a find, any other key is appended to
+ * one of 2^partitionBits run files picked by the high bits of its hash. The
+ * table and the run files therefore hold disjoint keys. A key seen again
+ * after it spilled lands in the same file, and loading a partition replays
+ * the file through hashTable_insert, so the last value wins just as it would
+ * in memory.
+ *
+ * Each run file is written through its own buffer, allocated when the
+ * partition first spills. Buffers are HASHTABLESPILL_BUFFER_SIZE, or smaller
+ * so that together they take at most a quarter of the budget, never under
+ * 4KB. All of them are reserved out of the budget from the start, as is the
+ * memory of the spill itself. Files are <prefix>.<partition>. A partition
+ * that is still too large to load can be fed to a new spill with more
+ * partitionBits, the extra bits split it further.
+ *
+ * The estimate only follows inserts made through this API, do not delete
+ * from the table while spilling.
+*******************************************************************************/
+
+#ifndef HASHTABLESPILL_BUFFER_SIZE
+#define HASHTABLESPILL_BUFFER_SIZE (256*1024)
+#endif
+
+#define HASHTABLESPILL_MAX_BITS (12)
+
+typedef struct HashTableSpill HashTableSpill;
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableSpill_open(
+	HashTableSpill **spill_p,      // address to write pointer to the spill
+	HashTable      *ht,            // resident table, may already hold keys
+	const char     *prefix,        // run files are <prefix>.<partition>
+	uint64_t       budget,         // bytes the table may grow to
+	uint32_t       partitionBits); // 1 to HASHTABLESPILL_MAX_BITS
+
+// Same return values as hashTable_insert, plus hashTable_spilled when the
+// key went to a run file.
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableSpill_insert(
+	HashTableSpill *spill,
+	uint8_t        *key,     // pointer to string key
+	uint8_t        keyLen,   // length of key in bytes(not including null)
+	HtValue        value);   // value to be stored
+
+// write out every partition buffer
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableSpill_flush(HashTableSpill *spill);
+
+HASHTABLE_STATIC_BUILD
+uint32_t
+hashTableSpill_partitionCount(HashTableSpill *spill);
+
+// records written to run files, repeats of a key each count
+HASHTABLE_STATIC_BUILD
+uint64_t
+hashTableSpill_spilledCount(HashTableSpill *spill);
+
+// Insert the records of one partition in to ht, in the order they spilled.
+// ht should be an empty table, not the resident one.
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableSpill_loadPartition(
+	HashTableSpill *spill,
+	uint32_t       partition,
+	HashTable      *ht);
+
+// close and remove the run files and free the spill, the table is untouched
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableSpill_close(HashTableSpill **spill_p);
+
+#endif
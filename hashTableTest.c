@@ -3,7 +3,20 @@
 #include <string.h>
 #include <stdint.h>
 
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
 #include "hashTable.h"
+#include "hashTableLog.h"
+#include "hashTableTrace.h"
+#include "hashTableShm.h"
+#include "hashTableSpill.h"
+#include <sys/wait.h>
 
 typedef uint8_t  u8;
 typedef int8_t   s8;
@@ -15,13 +28,283 @@ typedef float    f32;
 typedef double   f64;
 
 #define UPPER_LIMIT 1000000
+#define LOG_LIMIT   100000
+#define TRACE_LIMIT 1000
+#define LOG_PATH    "bin/hashTableTest.log"
+#define TRACE_PATH  "bin/hashTableTest.trace"
+#define SHM_NAME    "/hashTableTest"
+#define SHM_READERS 2
+#define SPILL_PATH  "bin/hashTableTest.spill"
+
+#define TLB_LIMIT   (1<<21)
+
+// compiled from hashTableTestKeys.txt by hashTableGen
+extern const HashTableFrozen hashTableTestKeys;
 
 //#define PRINTOUT
 
-int main(void)
+static s64
+openTlbMissCounter(void)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_DTLB
+		| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+		| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// random order lookups over a table much larger than the TLB reach
+static void
+benchBucketArray(u32 flags)
 {
 	HashTable *ht;
 	hashTableNode *node;
+	HashTableStats stats;
+	struct timespec start, end;
+	s64 fd, misses = -1;
+	f64 nanos;
+	
+	hashTable_initWithFlags(&ht, flags);
+	for (s64 x=1; x<=TLB_LIMIT; x++){
+		hashTable_insertIntKey(ht, x, x);
+	}
+	fd = openTlbMissCounter();
+	if(fd >= 0){
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (s64 x=0; x<TLB_LIMIT; x++){
+		if(hashTable_findIntKey(ht, (x*2654435761)%TLB_LIMIT+1, &node)){
+			printf("Strange failure to find %ld\n", x);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if(fd >= 0){
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if(read(fd, &misses, sizeof(misses)) != sizeof(misses)){
+			misses = -1;
+		}
+		close(fd);
+	}
+	nanos = (end.tv_sec-start.tv_sec)*1e9 + (end.tv_nsec-start.tv_nsec);
+	hashTable_getStats(ht, &stats);
+	if( stats.tablePageSize && ((uintptr_t)ht->table % (2*1024*1024)) ){
+		printf("Strange mapped bucket array is not 2MB aligned\n");
+	}
+	printf("table page size %8u: %.1f ns per find, ",
+		stats.tablePageSize, nanos/TLB_LIMIT);
+	if(misses >= 0){
+		printf("%ld dTLB read misses\n", misses);
+	} else {
+		printf("dTLB read misses unavailable\n");
+	}
+	hashTable_freeAll(&ht);
+}
+
+typedef struct SnapshotCheck {
+	HashTableSnapshot *snap;
+	u64 nodes;
+	u64 sum;
+	u64 bad;
+} SnapshotCheck;
+
+static s32
+sumSnapshotNode(hashTableNode *node, void *parameter)
+{
+	SnapshotCheck *check = parameter;
+	check->nodes++;
+	check->sum += node->value;
+	return 0;
+}
+
+// reads the snapshot while main keeps changing the table
+static void *
+snapshotReader(void *parameter)
+{
+	SnapshotCheck *check = parameter;
+	HtValue value;
+	u8 keyBuffer[16];
+	u8 keyLen;
+	hashTable_traverseSnapshot(check->snap, sumSnapshotNode, check);
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		keyLen = hashTable_s64toString(x, keyBuffer);
+		if(hashTable_findSnapshot(check->snap, keyBuffer, keyLen, &value)
+			|| (value != (u64)x)){
+			check->bad++;
+		}
+	}
+	return 0;
+}
+
+typedef struct OrderCheck {
+	HashTableDense *dt;
+	s64 expect;
+	u64 sum;
+	u64 bad;
+} OrderCheck;
+
+// evens up to UPPER_LIMIT were kept, then UPPER_LIMIT/2 more were appended
+static s32
+checkDenseOrder(HashTableDenseEntry *entry, OrderCheck *check)
+{
+	u8 keyBuffer[16];
+	u8 keyLen = hashTable_s64toString(check->expect, keyBuffer);
+	if( ((s64)entry->value != check->expect) || (entry->keyLen != keyLen)
+		|| memcmp(HASHTABLE_DENSE_KEY(check->dt, entry), keyBuffer, keyLen) ){
+		check->bad++;
+	}
+	check->expect += (check->expect < UPPER_LIMIT) ? 2 : 1;
+	return 0;
+}
+
+static s32
+sumDenseEntry(HashTableDenseEntry *entry, u64 *sum)
+{
+	*sum += entry->value;
+	return 0;
+}
+
+static s32
+sumNode(hashTableNode *node, u64 *sum)
+{
+	*sum += node->value;
+	return 0;
+}
+
+// counts join matches, called from several threads
+static s32
+countMatch(hashTableNode *left, hashTableNode *right, u64 *matches)
+{
+	if( left && right && (left->value == right->value) ){
+		__atomic_fetch_add(matches, 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+// counts join matches and sums their keys, called from several threads
+static s32
+sumMatch(hashTableNode *left, hashTableNode *right, u64 *sums)
+{
+	if( left && right && (left->value == right->value) ){
+		__atomic_fetch_add(&sums[0], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&sums[1], hashTable_stringTos64(left->key),
+			__ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+#ifdef HASHTABLE_INSTRUMENT
+static void
+printHistogram(const char *name, HashTableOpHistogram *hist)
+{
+	printf("%-6s samples %6ld hits %6ld resized %3ld avg chain %.2f "
+		"p50 %6ld p99 %6ld p99.9 %7ld max %8ld ticks\n",
+		name, hist->samples, hist->hits, hist->resized,
+		hist->samples ? (f64)hist->chainTotal/hist->samples : 0.0,
+		hashTable_histogramQuantile(hist, 0.5),
+		hashTable_histogramQuantile(hist, 0.99),
+		hashTable_histogramQuantile(hist, 0.999),
+		hist->maxTicks);
+}
+#endif
+
+// attaches in a child process, even keys must always be found with x or 2x
+static s32
+shmReader(void)
+{
+	HashTableShm *shm;
+	HtValue value;
+	u8 keyBuffer[16];
+	u8 keyLen;
+	u32 bad = 0;
+	if(hashTableShm_attach(&shm, SHM_NAME)){
+		return 255;
+	}
+	for (u32 pass=0; pass<10; pass++){
+		for (s64 x=2; x<=LOG_LIMIT; x+=2){
+			keyLen = hashTable_s64toString(x, keyBuffer);
+			if( hashTableShm_find(shm, keyBuffer, keyLen, &value)
+				|| ((value != (u64)x) && (value != (u64)x*2)) ){
+				bad++;
+			}
+		}
+	}
+	hashTableShm_detach(&shm);
+	return bad > 254 ? 254 : bad;
+}
+
+// resident set size of the process, 0 if unknown
+static u64
+residentBytes(void)
+{
+	FILE *statm = fopen("/proc/self/statm", "r");
+	u64 pages = 0, resident = 0;
+	if(statm){
+		if(fscanf(statm, "%lu %lu", &pages, &resident) != 2){
+			resident = 0;
+		}
+		fclose(statm);
+	}
+	return resident*sysconf(_SC_PAGESIZE);
+}
+
+// counts finds reported to the hook in *ctx
+static void
+countFinds(void *ctx, u32 op, u8 *key, u8 keyLen, HtValue value)
+{
+	(void)key;
+	(void)keyLen;
+	(void)value;
+	if( (op == hashTable_opFind) || (op == hashTable_opFindMiss) ){
+		(*(u64*)ctx)++;
+	}
+}
+
+static f64
+secondsSince(struct timespec *start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec-start->tv_sec) + (end.tv_nsec-start->tv_nsec)*1e-9;
+}
+
+int main(void)
+{
+	HashTable *ht, *htOther, *result;
+	hashTableNode *node;
+	HashTableStats stats;
+	FILE *file;
+	HashTableLog *log;
+	HashTableFrozen *frozen;
+	u8 *serialized;
+	u64 serializedLen;
+	HtValue value;
+	SnapshotCheck snapCheck;
+	pthread_t reader;
+	HashTableCompact *compact;
+	size_t heapBefore;
+	HashTableDense *dense;
+	OrderCheck orderCheck;
+	struct timespec start;
+	u64 matches, joinSums[2][2];
+	HashTableTrace *trace;
+	HashTableTraceReader *traceReader;
+	HashTableTraceRecord traceRecord;
+	HashTableShm *shm;
+	HashTableSpill *spill;
+	HashTableFragmentation frag;
+	HashTableSnapshot *snap;
+	u8 *blob;
+	u32 blobLen;
+	u8 keyBuffer[16];
+	u8 keyLen;
 	char buff[128];
 	s64 res=0;
 	s32 returnCode;
@@ -31,6 +314,11 @@ int main(void)
 	if(returnCode){
 		printf("hashTable_init: %s\n", hashTable_debugString(returnCode));
 	}
+#ifndef HASHTABLE_INSTRUMENT
+	if(ht->instrument){
+		printf("Strange instrument without HASHTABLE_INSTRUMENT\n");
+	}
+#endif
 	for (s64 x=1; x<=UPPER_LIMIT; x++){
 		sprintf(buff, "%ld", x);
 		if ( hashTable_insert(ht, (u8*)buff, strlen(buff), 0) ){
@@ -40,7 +328,7 @@ int main(void)
 	
 	res = hashTable_countEachNode(ht);
 	printf("hashTable_countEachNode is %ld\n", res);
-	printf("ht->count is %d\n", ht->count);
+	printf("ht->count is %ld\n", ht->count);
 	res = hashTable_maxChain(ht);
 	printf("hashTable_maxDepth is %ld\n", res);
 	
@@ -57,7 +345,7 @@ int main(void)
 	
 	res = hashTable_countEachNode(ht);
 	printf("hashTable_countEachNode is %ld\n", res);
-	printf("ht->count is %d\n", ht->count);
+	printf("ht->count is %ld\n", ht->count);
 	
 	for (s64 x=1; x<=UPPER_LIMIT; x++){
 		if(hashTable_insertIntKey(ht, x, 0)){
@@ -67,10 +355,23 @@ int main(void)
 	
 	res = hashTable_countEachNode(ht);
 	printf("hashTable_countEachNode is %ld\n", res);
-	printf("ht->count is %d\n", ht->count);
+	printf("ht->count is %ld\n", ht->count);
 	res = hashTable_maxChain(ht);
 	printf("hashTable_maxDepth is %ld\n", res);
 	
+	keyLen = hashTable_s64toString(7, keyBuffer);
+	if( (hashTable_update(ht, keyBuffer, keyLen, 70)
+		!= hashTable_updatedValOfExistingKey)
+		|| hashTable_findIntKey(ht, 7, &node) || (node->value != 70) ){
+		printf("Strange failure to update 7\n");
+	}
+	keyLen = hashTable_s64toString(-7, keyBuffer);
+	res = ht->count;
+	if( (hashTable_update(ht, keyBuffer, keyLen, 70) != hashTable_nothingFound)
+		|| (ht->count != (u64)res) ){
+		printf("Strange update of a missing key\n");
+	}
+	
 	for (s64 x=1; x<=UPPER_LIMIT; x++){
 		hashTable_findIntKey(ht, x, &node);
 		#ifdef PRINTOUT
@@ -81,13 +382,879 @@ int main(void)
 	
 	res = hashTable_countEachNode(ht);
 	printf("hashTable_countEachNode is %ld\n", res);
-	printf("ht->count is %d\n", ht->count);
+	printf("ht->count is %ld\n", ht->count);
 	
 	printf("calling free all\n");
 	hashTable_freeAll(&ht);
 	
 	res = hashTable_countEachNode(ht);
 	printf("hashTable_countEachNode is %ld\n", res);
+	
+	printf("Hardened table:\n");
+	returnCode=hashTable_initWithFlags(&ht, hashTable_flagHardened);
+	if(returnCode){
+		printf("hashTable_initWithFlags: %s\n", hashTable_debugString(returnCode));
+	}
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		sprintf(buff, "%ld", x);
+		if ( hashTable_insert(ht, (u8*)buff, strlen(buff), x) ){
+			printf("Strange failure to insert %ld\n", x);
+		}
+	}
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		sprintf(buff, "%ld", x);
+		if ( hashTable_find(ht, (u8*)buff, strlen(buff), &node)
+			|| (node->value != (u64)x) ){
+			printf("Strange failure to find %ld\n", x);
+		}
+	}
+	hashTable_getStats(ht, &stats);
+	printf("count %ld resizes %d reseeds %d\n",
+		stats.count, stats.resizes, stats.reseeds);
+	res = hashTable_maxChain(ht);
+	printf("hashTable_maxDepth is %ld\n", res);
+	// keep only keys whose stored hash lands in bucket 0 until the chain is
+	// long enough to reseed
+	hashTable_initWithFlags(&htOther, hashTable_flagHardened);
+	for (s64 x=1; x<=600; x++){
+		hashTable_insertIntKey(htOther, -x, x);
+	}
+	hashTable_getStats(htOther, &stats);
+	value = hashTable_getSeed(htOther);
+	matches = 0;
+	for (s64 x=1; (x<=1000000) && (stats.reseeds == 0); x++){
+		hashTable_insertIntKey(htOther, x, x);
+		hashTable_getStats(htOther, &stats);
+		if( (stats.reseeds == 0) && (hashTable_findIntKey(htOther, x, &node)
+			== hashTable_OK) && (node->hash & (stats.size-1)) ){
+			hashTable_deleteIntKey(htOther, x, 0);
+		} else {
+			matches++;
+		}
+	}
+	printf("reseeds %d after %ld colliding keys, max chain now %d\n",
+		stats.reseeds, matches, hashTable_maxChain(htOther));
+	if( (stats.reseeds == 0) || (hashTable_getSeed(htOther) == value)
+		|| (hashTable_maxChain(htOther) >= HASHTABLE_MAX_CHAIN) ){
+		printf("Strange hardened table did not reseed\n");
+	}
+	for (s64 x=1; x<=600; x++){
+		if( hashTable_findIntKey(htOther, -x, &node) || (node->value != (u64)x) ){
+			printf("Strange failure to find %ld after reseed\n", -x);
+		}
+	}
+	if(hashTable_getCount(htOther) != 600+matches){
+		printf("Strange count after reseed\n");
+	}
+	for (u64 y=0; y<htOther->size; y++){
+		for (hashTableNode *curNode=htOther->table[y]; curNode;
+			curNode=curNode->next){
+			if( hashTable_find(htOther, curNode->key, curNode->keyLen, &node)
+				|| (node != curNode) ){
+				printf("Strange failure to find a node after reseed\n");
+			}
+		}
+	}
+	hashTable_freeAll(&htOther);
+	
+	printf("Frozen table:\n");
+	returnCode=hashTable_freeze(ht, &frozen);
+	if(returnCode){
+		printf("hashTable_freeze: %s\n", hashTable_debugString(returnCode));
+	}
+	hashTable_freeAll(&ht);
+	returnCode=hashTable_serializeFrozen(frozen, &serialized, &serializedLen);
+	hashTable_freeFrozen(&frozen);
+	returnCode|=hashTable_deserializeFrozen(serialized, serializedLen, &frozen);
+	if(returnCode){
+		printf("Strange failure to serialize frozen table\n");
+	}
+	printf("frozen bytes per entry %.1f\n", (double)serializedLen/UPPER_LIMIT);
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		sprintf(buff, "%ld", x);
+		if ( hashTable_findFrozen(frozen, (u8*)buff, strlen(buff), &value)
+			|| (value != (u64)x) ){
+			printf("Strange failure to find frozen %ld\n", x);
+		}
+		sprintf(buff, "-%ld", x);
+		if ( hashTable_findFrozen(frozen, (u8*)buff, strlen(buff), &value)
+			!= hashTable_nothingFound ){
+			printf("Strange frozen find of missing %s\n", buff);
+		}
+	}
+	// a deserialized table points in to the buffer, push a key past the end
+	((u32*)frozen->keyOffsets)[frozen->count-1] = 0x7FFFFFFF;
+	hashTable_freeFrozen(&frozen);
+	if(hashTable_deserializeFrozen(serialized, serializedLen, &frozen)
+		!= hashTable_errorCorrupt){
+		printf("Strange deserialize of a corrupt key offset\n");
+	}
+	free(serialized);
+	// small and large key sets freeze at the default seed
+	for (u32 size=0; size<4; size++){
+		s64 sizes[] = {2, 10, 1000, 100000};
+		hashTable_init(&htOther);
+		for (s64 x=1; x<=sizes[size]; x++){
+			hashTable_insertIntKey(htOther, x, x);
+		}
+		returnCode=hashTable_freeze(htOther, &frozen);
+		hashTable_freeAll(&htOther);
+		if(returnCode){
+			printf("Strange freeze of %ld keys: %s\n", sizes[size],
+				hashTable_debugString(returnCode));
+			continue;
+		}
+		for (s64 x=1; x<=sizes[size]; x++){
+			if( hashTable_findFrozenIntKey(frozen, x, &value)
+				|| (value != (u64)x) ){
+				printf("Strange frozen %ld of %ld keys\n", x, sizes[size]);
+			}
+		}
+		if(hashTable_findFrozenIntKey(frozen, -1, &value) != hashTable_nothingFound){
+			printf("Strange frozen find of a missing key\n");
+		}
+		hashTable_freeFrozen(&frozen);
+	}
+	
+	printf("Compact table:\n");
+	heapBefore = mallinfo2().uordblks;
+	hashTable_init(&ht);
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		hashTable_insertIntKey(ht, x, x);
+	}
+	printf("node table heap bytes per entry %.1f\n",
+		(f64)(mallinfo2().uordblks-heapBefore)/UPPER_LIMIT);
+	hashTable_freeAll(&ht);
+	returnCode=hashTable_initCompact(&compact);
+	if(returnCode){
+		printf("hashTable_initCompact: %s\n", hashTable_debugString(returnCode));
+	}
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		sprintf(buff, "%ld", x);
+		if ( hashTable_insertCompact(compact, (u8*)buff, strlen(buff), x) ){
+			printf("Strange failure to insert compact %ld\n", x);
+		}
+	}
+	printf("compact table bytes per entry %.1f\n",
+		(f64)hashTable_bytesCompact(compact)/UPPER_LIMIT);
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		sprintf(buff, "%ld", x);
+		if ( hashTable_findCompact(compact, (u8*)buff, strlen(buff), &value)
+			|| (value != (u64)x) ){
+			printf("Strange failure to find compact %ld\n", x);
+		}
+		if(x%2){
+			hashTable_deleteCompact(compact, (u8*)buff, strlen(buff), 0);
+		}
+	}
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		sprintf(buff, "%ld", x);
+		if ( hashTable_findCompact(compact, (u8*)buff, strlen(buff), &value)
+			!= ((x%2) ? hashTable_nothingFound : hashTable_OK) ){
+			printf("Strange compact result after delete %ld\n", x);
+		}
+	}
+	printf("compact count is %d\n", compact->count);
+	hashTable_freeCompact(&compact);
+	
+	printf("Dense table:\n");
+	returnCode=hashTable_initDense(&dense);
+	if(returnCode){
+		printf("hashTable_initDense: %s\n", hashTable_debugString(returnCode));
+	}
+	hashTable_init(&ht);
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		hashTable_insertIntKey(ht, x, x);
+		keyLen = hashTable_s64toString(x, keyBuffer);
+		if( hashTable_insertDense(dense, keyBuffer, keyLen, x) ){
+			printf("Strange failure to insert dense %ld\n", x);
+		}
+	}
+	for (s64 x=1; x<=UPPER_LIMIT; x+=2){
+		hashTable_deleteIntKey(ht, x, 0);
+		keyLen = hashTable_s64toString(x, keyBuffer);
+		if( hashTable_deleteDense(dense, keyBuffer, keyLen, 0) ){
+			printf("Strange failure to delete dense %ld\n", x);
+		}
+	}
+	for (s64 x=UPPER_LIMIT+1; x<=UPPER_LIMIT+UPPER_LIMIT/2; x++){
+		hashTable_insertIntKey(ht, x, x);
+		keyLen = hashTable_s64toString(x, keyBuffer);
+		hashTable_insertDense(dense, keyBuffer, keyLen, x);
+	}
+	for (s64 x=1; x<=UPPER_LIMIT+UPPER_LIMIT/2; x++){
+		keyLen = hashTable_s64toString(x, keyBuffer);
+		if( hashTable_findDense(dense, keyBuffer, keyLen, &value)
+			!= (((x%2) && (x<=UPPER_LIMIT)) ? hashTable_nothingFound : 0) ){
+			printf("Strange dense find result %ld\n", x);
+		}
+	}
+	orderCheck.dt = dense;
+	orderCheck.expect = 2;
+	orderCheck.bad = 0;
+	orderCheck.sum = 0;
+	HASHTABLE_DENSE_TRAVERSAL(dense, checkDenseOrder, &orderCheck);
+	printf("dense count %d, %ld out of order\n", dense->count, orderCheck.bad);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (s64 x=0; x<10; x++){
+		HASHTABLE_DENSE_TRAVERSAL(dense, sumDenseEntry, &orderCheck.sum);
+	}
+	printf("dense scan %.2f ms, ", secondsSince(&start)*100);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (s64 x=0; x<10; x++){
+		HASHTABLE_TRAVERSAL(ht, sumNode, &orderCheck.sum);
+	}
+	printf("node table scan %.2f ms\n", secondsSince(&start)*100);
+	if(orderCheck.sum == 0){
+		printf("Strange dense scan sum\n");
+	}
+	hashTable_freeDense(&dense);
+	hashTable_freeAll(&ht);
+	
+	printf("Snapshot:\n");
+	hashTable_init(&ht);
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		hashTable_insertIntKey(ht, x, x);
+	}
+	snapCheck.nodes = snapCheck.sum = snapCheck.bad = 0;
+	returnCode=hashTable_snapshot(ht, &snapCheck.snap);
+	if(returnCode){
+		printf("hashTable_snapshot: %s\n", hashTable_debugString(returnCode));
+	}
+	pthread_create(&reader, 0, snapshotReader, &snapCheck);
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		hashTable_insertIntKey(ht, x, 2*x);
+		if(x%2){
+			hashTable_deleteIntKey(ht, x, 0);
+		}
+		if(x%4==0){
+			hashTable_insertIntKey(ht, -x, x);
+		}
+	}
+	pthread_join(reader, 0);
+	printf("snapshot saw %ld nodes, sum ok %d, %ld bad finds\n",
+		snapCheck.nodes,
+		snapCheck.sum == (u64)UPPER_LIMIT*(UPPER_LIMIT+1)/2,
+		snapCheck.bad);
+	hashTable_freeAll(&ht);
+	snapCheck.nodes = snapCheck.sum = 0;
+	snapshotReader(&snapCheck);
+	printf("after freeAll snapshot saw %ld nodes, %ld bad finds\n",
+		snapCheck.nodes, snapCheck.bad);
+	hashTable_releaseSnapshot(&snapCheck.snap);
+	// growing past the size while attached resizes on release, not before
+	hashTable_init(&ht);
+	for (s64 x=1; x<=1000; x++){
+		hashTable_insertIntKey(ht, x, x);
+	}
+	hashTable_getStats(ht, &stats);
+	res = stats.resizes;
+	hashTable_snapshot(ht, &snapCheck.snap);
+	for (s64 x=1001; x<=8000; x++){
+		hashTable_insertIntKey(ht, x, x);
+	}
+	hashTable_getStats(ht, &stats);
+	keyLen = hashTable_s64toString(1000, keyBuffer);
+	if( (stats.resizes != res)
+		|| hashTable_findSnapshot(snapCheck.snap, keyBuffer, keyLen, &value) ){
+		printf("Strange resize with a snapshot attached\n");
+	}
+	keyLen = hashTable_s64toString(1001, keyBuffer);
+	if(hashTable_findSnapshot(snapCheck.snap, keyBuffer, keyLen, &value)
+		!= hashTable_nothingFound){
+		printf("Strange snapshot sees a later insert\n");
+	}
+	hashTable_releaseSnapshot(&snapCheck.snap);
+	hashTable_getStats(ht, &stats);
+	printf("deferred resize to %ld buckets for %ld nodes\n", stats.size,
+		stats.count);
+	if( (stats.resizes != res+1) || (stats.size < stats.count) ){
+		printf("Strange resize after release\n");
+	}
+	for (s64 x=1; x<=8000; x++){
+		if( hashTable_findIntKey(ht, x, &node) || (node->value != (u64)x) ){
+			printf("Strange failure to find %ld after deferred resize\n", x);
+		}
+	}
+	hashTable_freeAll(&ht);
+	
+	printf("Blob values:\n");
+	hashTable_initWithFlags(&ht, hashTable_flagBlobValues);
+	hashTable_init(&htOther);
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		keyLen = hashTable_s64toString(x, keyBuffer);
+		sprintf(buff, "value of key %ld padded out past 8 bytes", x);
+		hashTable_insertBlob(ht, keyBuffer, keyLen, buff, strlen(buff)+1);
+		hashTable_insertIntKey(htOther, x, 0);
+	}
+	// the same blobs behind pointers, allocated apart from their nodes
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		sprintf(buff, "value of key %ld padded out past 8 bytes", x);
+		hashTable_findIntKey(htOther, x, &node);
+		node->value = (u64)strdup(buff);
+	}
+	for (u32 pass=0; pass<2; pass++){
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		res = 0;
+		for (s64 x=1; x<=UPPER_LIMIT; x+=7){
+			u8 *blob;
+			u32 blobLen;
+			keyLen = hashTable_s64toString(x, keyBuffer);
+			if(pass == 0){
+				hashTable_findBlob(ht, keyBuffer, keyLen, &blob, &blobLen);
+			} else {
+				hashTable_find(htOther, keyBuffer, keyLen, &node);
+				blob = (u8*)node->value;
+			}
+			res += blob[13];
+		}
+		printf("%s %.2f ms, ", pass ? "pointer blobs" : "inline blobs",
+			secondsSince(&start)*1000);
+	}
+	printf("\n");
+	{
+		u8 *blob, *before;
+		u32 blobLen;
+		keyLen = hashTable_s64toString(42, keyBuffer);
+		hashTable_findBlob(ht, keyBuffer, keyLen, &before, &blobLen);
+		hashTable_insertBlob(ht, keyBuffer, keyLen, "short", 6);
+		hashTable_findBlob(ht, keyBuffer, keyLen, &blob, &blobLen);
+		if( (blob != before) || (blobLen != 6) || strcmp((char*)blob, "short") ){
+			printf("Strange failure to update blob in place\n");
+		}
+		memset(buff, 'x', 100);
+		hashTable_insertBlob(ht, keyBuffer, keyLen, buff, 100);
+		hashTable_findBlob(ht, keyBuffer, keyLen, &blob, &blobLen);
+		if( (blobLen != 100) || memcmp(blob, buff, 100) ){
+			printf("Strange failure to grow blob\n");
+		}
+		keyLen = hashTable_s64toString(UPPER_LIMIT, keyBuffer);
+		hashTable_findBlob(ht, keyBuffer, keyLen, &blob, &blobLen);
+		sprintf(buff, "value of key %d padded out past 8 bytes", UPPER_LIMIT);
+		if( (blobLen != strlen(buff)+1) || strcmp((char*)blob, buff) ){
+			printf("Strange blob for last key\n");
+		}
+		if(hashTable_freeze(ht, &frozen) != hashTable_errorCannotFreeze){
+			printf("Strange freeze of a blob table\n");
+		}
+	}
+	hashTable_freeAll(&ht);
+	for (u64 x=0; x<htOther->size; x++){
+		for (node=htOther->table[x]; node; node=node->next){
+			free((void*)node->value);
+		}
+	}
+	hashTable_freeAll(&htOther);
+	
+	printf("Set operations:\n");
+	hashTable_init(&ht);
+	hashTable_initWithFlags(&htOther, hashTable_flagHardened);
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		hashTable_insertIntKey(ht, x, x);
+		hashTable_insertIntKey(htOther, x+UPPER_LIMIT/2, x+UPPER_LIMIT/2);
+	}
+	hashTable_init(&result);
+	matches = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	hashTable_intersect(ht, htOther, result,
+		(hashTable_joinFn)countMatch, &matches, 4);
+	printf("intersect %ld keys, %ld matches, %.2f ms\n",
+		hashTable_getCount(result), matches, secondsSince(&start)*1000);
+	if( (hashTable_getCount(result) != UPPER_LIMIT/2) || (matches != UPPER_LIMIT/2)
+		|| hashTable_findIntKey(result, UPPER_LIMIT, &node)
+		|| (node->value != UPPER_LIMIT) ){
+		printf("Strange intersect result\n");
+	}
+	hashTable_freeAll(&result);
+	hashTable_init(&result);
+	hashTable_union(ht, htOther, result, 0, 0, 4);
+	printf("union %ld keys\n", hashTable_getCount(result));
+	if(hashTable_getCount(result) != UPPER_LIMIT/2*3){
+		printf("Strange union result\n");
+	}
+	hashTable_freeAll(&result);
+	hashTable_init(&result);
+	hashTable_difference(ht, htOther, result, 0, 0, 1);
+	printf("difference %ld keys\n", hashTable_getCount(result));
+	if( (hashTable_getCount(result) != UPPER_LIMIT/2)
+		|| (hashTable_findIntKey(result, UPPER_LIMIT, &node) == 0) ){
+		printf("Strange difference result\n");
+	}
+	hashTable_freeAll(&result);
+	// same seed and hash mode, stored hashes are reused
+	hashTable_freeAll(&htOther);
+	hashTable_init(&htOther);
+	hashTable_setSeed(htOther, hashTable_getSeed(ht));
+	for (s64 x=UPPER_LIMIT/2; x<=UPPER_LIMIT*2; x++){
+		hashTable_insertIntKey(htOther, x, x);
+	}
+	// 4 threads only run faster with as many cpus, the results must match
+	printf("%ld cpu(s) online\n", sysconf(_SC_NPROCESSORS_ONLN));
+	for (u32 threads=1; threads<=4; threads*=4){
+		joinSums[threads/4][0] = joinSums[threads/4][1] = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		hashTable_join(htOther, ht, (hashTable_joinFn)sumMatch,
+			joinSums[threads/4], threads);
+		printf("join %d thread(s) %ld matches, %.2f ms\n",
+			threads, joinSums[threads/4][0], secondsSince(&start)*1000);
+	}
+	if( (joinSums[0][0] != UPPER_LIMIT/2+1)
+		|| (joinSums[1][0] != joinSums[0][0])
+		|| (joinSums[1][1] != joinSums[0][1]) ){
+		printf("Strange join result\n");
+	}
+	hashTable_freeAll(&htOther);
+	hashTable_freeAll(&ht);
+	
+#ifdef HASHTABLE_INSTRUMENT
+	printf("Instrumentation, 1 in %d calls:\n", HASHTABLE_INSTRUMENT);
+	hashTable_init(&ht);
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		hashTable_insertIntKey(ht, x, x);
+	}
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		hashTable_findIntKey(ht, x*2, &node);
+	}
+	for (s64 x=1; x<=UPPER_LIMIT; x+=2){
+		hashTable_deleteIntKey(ht, x, 0);
+	}
+	{
+		HashTableInstrument inst;
+		hashTable_getInstrument(ht, &inst);
+		printHistogram("insert", &inst.ops[hashTable_sampleInsert]);
+		printHistogram("find", &inst.ops[hashTable_sampleFind]);
+		printHistogram("delete", &inst.ops[hashTable_sampleDelete]);
+		if( (inst.ops[hashTable_sampleInsert].samples
+			!= UPPER_LIMIT/HASHTABLE_INSTRUMENT)
+			|| (inst.ops[hashTable_sampleFind].hits
+			!= UPPER_LIMIT/HASHTABLE_INSTRUMENT/2) ){
+			printf("Strange insert samples\n");
+		}
+		hashTable_resetInstrument(ht);
+		hashTable_getInstrument(ht, &inst);
+		if(inst.recorded || inst.ops[hashTable_sampleFind].samples){
+			printf("Strange failure to reset samples\n");
+		}
+	}
+	hashTable_freeAll(&ht);
+	
+#endif
+	printf("Bucket array pages:\n");
+	benchBucketArray(0);
+	benchBucketArray(hashTable_flagHugePages);
+	
+	printf("Write ahead log:\n");
+	unlink(LOG_PATH);
+	unlink(LOG_PATH ".old");
+	unlink(LOG_PATH ".snap");
+	hashTable_init(&ht);
+	returnCode=hashTableLog_open(&log, ht, LOG_PATH, 4096, 1000, 256*1024);
+	if(returnCode){
+		printf("hashTableLog_open: %s\n", hashTable_debugString(returnCode));
+	}
+	for (s64 x=1; x<=LOG_LIMIT; x++){
+		hashTable_insertIntKey(ht, x, x);
+		if(x == LOG_LIMIT/2){
+			hashTableLog_compact(log);
+		}
+	}
+	for (s64 x=1; x<=LOG_LIMIT; x+=2){
+		hashTable_deleteIntKey(ht, x, 0);
+	}
+	returnCode=hashTableLog_close(&log);
+	if(returnCode){
+		printf("hashTableLog_close: %s\n", hashTable_debugString(returnCode));
+	}
+	hashTable_freeAll(&ht);
+	hashTable_init(&ht);
+	returnCode=hashTableLog_open(&log, ht, LOG_PATH, 0, 0, 0);
+	if(returnCode){
+		printf("hashTableLog_open: %s\n", hashTable_debugString(returnCode));
+	}
+	printf("recovered count is %ld\n", hashTable_getCount(ht));
+	for (s64 x=1; x<=LOG_LIMIT; x++){
+		if( (x&1) ? (hashTable_findIntKey(ht, x, &node) == hashTable_OK)
+			: (hashTable_findIntKey(ht, x, &node) || (node->value != (u64)x)) ){
+			printf("Strange failure to recover %ld\n", x);
+		}
+	}
+	hashTableLog_close(&log);
+	hashTable_freeAll(&ht);
+	// a record torn by a crash ends the log and is cut off on open
+	file = fopen(LOG_PATH, "ab");
+	if(file){
+		u8 torn[] = {0x12, 0x34, 0x56, 0x78, hashTable_opInsert, 8, 't', 'o'};
+		fwrite(torn, 1, sizeof(torn), file);
+		fclose(file);
+	}
+	hashTable_init(&ht);
+	returnCode=hashTableLog_open(&log, ht, LOG_PATH, 0, 0, 0);
+	if( returnCode || (hashTable_getCount(ht) != LOG_LIMIT/2) ){
+		printf("Strange recovery past a torn record\n");
+	}
+	hashTable_insertIntKey(ht, LOG_LIMIT+1, 1);
+	hashTableLog_close(&log);
+	hashTable_freeAll(&ht);
+	hashTable_init(&ht);
+	returnCode=hashTableLog_open(&log, ht, LOG_PATH, 0, 0, 0);
+	if( returnCode || (hashTable_getCount(ht) != LOG_LIMIT/2+1)
+		|| hashTable_findIntKey(ht, LOG_LIMIT+1, &node) ){
+		printf("Strange record lost after a torn tail\n");
+	}
+	hashTableLog_close(&log);
+	hashTable_freeAll(&ht);
+	// blob tables log each blob with its value, through a compaction too
+	unlink(LOG_PATH);
+	unlink(LOG_PATH ".snap");
+	hashTable_initWithFlags(&ht, hashTable_flagBlobValues);
+	returnCode=hashTableLog_open(&log, ht, LOG_PATH, 0, 0, 0);
+	for (s64 x=1; x<=1000; x++){
+		keyLen = hashTable_s64toString(x, keyBuffer);
+		sprintf(buff, "blob of key %ld", x);
+		hashTable_insertBlob(ht, keyBuffer, keyLen, buff, strlen(buff)+1);
+		if(x%3 == 0){
+			hashTable_insertIntKey(ht, x, x);
+		}
+		if(x == 500){
+			hashTableLog_compact(log);
+		}
+	}
+	{
+		// larger than the log buffer
+		u8 *big = calloc(1, HASHTABLELOG_BUFFER_SIZE*2);
+		keyLen = hashTable_s64toString(1001, keyBuffer);
+		hashTable_insertBlob(ht, keyBuffer, keyLen, big,
+			HASHTABLELOG_BUFFER_SIZE*2);
+		free(big);
+	}
+	returnCode|=hashTableLog_close(&log);
+	hashTable_freeAll(&ht);
+	hashTable_initWithFlags(&ht, hashTable_flagBlobValues);
+	returnCode|=hashTableLog_open(&log, ht, LOG_PATH, 0, 0, 0);
+	if( returnCode || (hashTable_getCount(ht) != 1001) ){
+		printf("Strange blob table recovery: %s\n",
+			hashTable_debugString(returnCode));
+	}
+	for (s64 x=1; x<=1000; x++){
+		u8 *blob;
+		keyLen = hashTable_s64toString(x, keyBuffer);
+		sprintf(buff, "blob of key %ld", x);
+		if( hashTable_findBlob(ht, keyBuffer, keyLen, &blob, &blobLen)
+			|| (blobLen != strlen(buff)+1) || memcmp(blob, buff, blobLen)
+			|| hashTable_findIntKey(ht, x, &node)
+			|| (node->value != (u64)((x%3 == 0) ? x : 0)) ){
+			printf("Strange failure to recover blob %ld\n", x);
+		}
+	}
+	if( hashTable_findIntKey(ht, 1001, &node)
+		|| (hashTable_nodeBlob(node, &blobLen)[HASHTABLELOG_BUFFER_SIZE] != 0)
+		|| (blobLen != HASHTABLELOG_BUFFER_SIZE*2) ){
+		printf("Strange failure to recover a large blob\n");
+	}
+	hashTableLog_close(&log);
+	hashTable_freeAll(&ht);
+	hashTable_init(&ht);
+	if(hashTableLog_recover(ht, LOG_PATH) != hashTable_errorNoBlobValues){
+		printf("Strange recovery of a blob log in to a plain table\n");
+	}
+	hashTable_freeAll(&ht);
+	unlink(LOG_PATH);
+	unlink(LOG_PATH ".new");
+	unlink(LOG_PATH ".old");
+	unlink(LOG_PATH ".snap");
+	
+	printf("Shared memory table:\n");
+	hashTableShm_unlink(SHM_NAME);
+	returnCode=hashTableShm_create(&shm, SHM_NAME, 64*1024*1024, LOG_LIMIT);
+	if(returnCode){
+		printf("hashTableShm_create: %s\n", hashTable_debugString(returnCode));
+	}
+	hashTable_init(&ht);
+	for (s64 x=1; x<=LOG_LIMIT; x++){
+		hashTable_insertIntKey(ht, x, x);
+	}
+	hashTableShm_insertAll(shm, ht);
+	hashTable_freeAll(&ht);
+	printf("shm count %ld, %.1f node bytes per entry\n",
+		hashTableShm_getCount(shm),
+		(f64)hashTableShm_bytesUsed(shm)/hashTableShm_getCount(shm));
+	for (u32 x=0; x<SHM_READERS; x++){
+		if(fork() == 0){
+			_exit(shmReader());
+		}
+	}
+	// churn odd keys and flip even values while the readers run
+	for (s64 round=1; round<=20; round++){
+		for (s64 x=1; x<=LOG_LIMIT; x++){
+			keyLen = hashTable_s64toString(x, keyBuffer);
+			if(x%2){
+				hashTableShm_delete(shm, keyBuffer, keyLen, 0);
+				hashTableShm_insert(shm, keyBuffer, keyLen, round);
+			} else {
+				hashTableShm_insert(shm, keyBuffer, keyLen, x*(1+round%2));
+			}
+		}
+	}
+	for (u32 x=0; x<SHM_READERS; x++){
+		wait(&returnCode);
+		if( !WIFEXITED(returnCode) || WEXITSTATUS(returnCode) ){
+			printf("Strange shm reader result %d\n", returnCode);
+		}
+	}
+	printf("shm count %ld after churn, %.1f node bytes per entry\n",
+		hashTableShm_getCount(shm),
+		(f64)hashTableShm_bytesUsed(shm)/hashTableShm_getCount(shm));
+	hashTableShm_detach(&shm);
+	hashTableShm_unlink(SHM_NAME);
+	
+	printf("Spill:\n");
+	hashTable_init(&ht);
+	heapBefore = mallinfo2().uordblks;
+	// lookups made by the spill are not user finds
+	value = 0;
+	hashTable_setHook(ht, countFinds, &value);
+	returnCode=hashTableSpill_open(&spill, ht, SPILL_PATH, 4*1024*1024, 4);
+	if(returnCode){
+		printf("hashTableSpill_open: %s\n", hashTable_debugString(returnCode));
+	}
+	// every key twice, the second value must win wherever the key lives
+	for (u32 round=1; round<=2; round++){
+		for (s64 x=1; x<=LOG_LIMIT; x++){
+			keyLen = hashTable_s64toString(x, keyBuffer);
+			returnCode=hashTableSpill_insert(spill, keyBuffer, keyLen, x*round);
+			if(returnCode < 0){
+				printf("hashTableSpill_insert: %s\n",
+					hashTable_debugString(returnCode));
+			}
+		}
+	}
+	printf("resident %ld, spilled records %ld, heap %.2f MB\n",
+		hashTable_getCount(ht), hashTableSpill_spilledCount(spill),
+		(mallinfo2().uordblks-heapBefore)/1048576.0);
+	if(mallinfo2().uordblks-heapBefore > 4*1024*1024){
+		printf("Strange spill heap over the budget\n");
+	}
+	if(value != 0){
+		printf("Strange spill lookups seen by the hook\n");
+	}
+	hashTable_setHook(ht, 0, 0);
+	res = hashTable_getCount(ht);
+	for (s64 x=1; x<=LOG_LIMIT; x++){
+		if( (hashTable_findIntKey(ht, x, &node) == hashTable_OK)
+			&& (node->value != (u64)x*2) ){
+			printf("Strange resident value %ld\n", x);
+		}
+	}
+	for (u32 x=0; x<hashTableSpill_partitionCount(spill); x++){
+		hashTable_init(&htOther);
+		returnCode=hashTableSpill_loadPartition(spill, x, htOther);
+		if(returnCode){
+			printf("hashTableSpill_loadPartition: %s\n",
+				hashTable_debugString(returnCode));
+		}
+		for (u64 y=0; y<htOther->size; y++){
+			for (hashTableNode *curNode=htOther->table[y]; curNode;
+				curNode=curNode->next){
+				if( (hashTable_find(ht, curNode->key, curNode->keyLen, &node)
+					== hashTable_OK) || (curNode->value % 2) ){
+					printf("Strange spilled key %s\n", curNode->key);
+				}
+			}
+		}
+		res += hashTable_getCount(htOther);
+		hashTable_freeAll(&htOther);
+	}
+	printf("resident plus partitions %ld keys\n", res);
+	if( (res != LOG_LIMIT) || (hashTableSpill_spilledCount(spill) == 0) ){
+		printf("Strange spill key count\n");
+	}
+	hashTableSpill_close(&spill);
+	hashTable_freeAll(&ht);
+	
+	printf("Trace:\n");
+	hashTable_init(&ht);
+	returnCode=hashTableTrace_start(&trace, ht, TRACE_PATH, 0);
+	if(returnCode){
+		printf("hashTableTrace_start: %s\n", hashTable_debugString(returnCode));
+	}
+	for (s64 x=1; x<=TRACE_LIMIT; x++){
+		hashTable_insertIntKey(ht, x, x);
+	}
+	for (s64 x=1; x<=TRACE_LIMIT*2; x++){
+		hashTable_findIntKey(ht, x, &node);
+	}
+	for (s64 x=1; x<=TRACE_LIMIT; x+=2){
+		hashTable_deleteIntKey(ht, x, 0);
+	}
+	hashTableTrace_stop(&trace);
+	hashTable_freeAll(&ht);
+	res = 0;
+	hashTableTrace_openReader(&traceReader, TRACE_PATH);
+	while(hashTableTrace_next(traceReader, &traceRecord) == hashTable_OK){
+		res++;
+		if(res <= TRACE_LIMIT){
+			keyLen = hashTable_s64toString(res, keyBuffer);
+			if( (traceRecord.op != hashTable_opInsert)
+				|| (traceRecord.value != (u64)res)
+				|| (traceRecord.keyLen != keyLen)
+				|| memcmp(traceRecord.key, keyBuffer, keyLen) ){
+				printf("Strange trace record %ld\n", res);
+			}
+		} else if( (res <= TRACE_LIMIT*3) && (traceRecord.op
+			!= ((res <= TRACE_LIMIT*2) ? hashTable_opFind
+			: hashTable_opFindMiss)) ){
+			printf("Strange trace find record %ld\n", res);
+		}
+	}
+	hashTableTrace_closeReader(&traceReader);
+	printf("trace has %ld records, last op %d\n", res, traceRecord.op);
+	if(res != TRACE_LIMIT*3+TRACE_LIMIT/2){
+		printf("Strange trace length\n");
+	}
+	unlink(TRACE_PATH);
+	
+	printf("Compaction:\n");
+	hashTable_init(&ht);
+	// churn so the survivors end up spread over the heap
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		hashTable_insertIntKey(ht, x, x);
+	}
+	for (s64 x=1; x<=UPPER_LIMIT; x++){
+		if(x%4){
+			hashTable_deleteIntKey(ht, x, 0);
+		}
+	}
+	for (s64 x=UPPER_LIMIT+1; x<=UPPER_LIMIT/4*5; x++){
+		hashTable_insertIntKey(ht, x, x);
+	}
+	hashTable_getFragmentation(ht, &frag);
+	printf("before: %ld heap nodes, %ld of %ld links split, %ld heap bytes free, "
+		"%ld resident\n", frag.heapNodes, frag.splitLinks, frag.links,
+		frag.heapFreeBytes, residentBytes());
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (s64 x=0; x<UPPER_LIMIT; x++){
+		hashTable_findIntKey(ht, (x*2654435761)%(UPPER_LIMIT/4*5)+1, &node);
+	}
+	printf("random finds %.2f ms\n", secondsSince(&start)*1000);
+	// a snapshot keeps seeing the nodes as they were
+	hashTable_snapshot(ht, &snap);
+	res = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while( (returnCode=hashTable_compact(ht, 4096)) == hashTable_compactPending ){
+		res++;
+	}
+	printf("compacted in %ld calls, %.2f ms\n", res+1,
+		secondsSince(&start)*1000);
+	if( (returnCode != hashTable_OK) || (res == 0) ){
+		printf("Strange compact: %s\n", hashTable_debugString(returnCode));
+	}
+	for (s64 x=4; x<=UPPER_LIMIT; x+=4){
+		keyLen = hashTable_s64toString(x, keyBuffer);
+		if( hashTable_findSnapshot(snap, keyBuffer, keyLen, &value)
+			|| (value != (u64)x) ){
+			printf("Strange snapshot value %ld after compact\n", x);
+		}
+	}
+	hashTable_releaseSnapshot(&snap);
+	hashTable_getFragmentation(ht, &frag);
+	printf("after: %ld heap nodes, %ld of %ld links split, %ld heap bytes free, "
+		"%ld resident, %ld of %ld slab bytes live\n", frag.heapNodes,
+		frag.splitLinks, frag.links, frag.heapFreeBytes, residentBytes(),
+		frag.slabLiveBytes, frag.slabBytes);
+	if( frag.heapNodes || frag.splitLinks || (frag.slabLiveBytes != frag.nodeBytes)
+		|| (hashTable_countEachNode(ht) != UPPER_LIMIT/2) ){
+		printf("Strange fragmentation after compact\n");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (s64 x=0; x<UPPER_LIMIT; x++){
+		hashTable_findIntKey(ht, (x*2654435761)%(UPPER_LIMIT/4*5)+1, &node);
+	}
+	printf("random finds %.2f ms\n", secondsSince(&start)*1000);
+	for (s64 x=1; x<=UPPER_LIMIT/4*5; x++){
+		if( (hashTable_findIntKey(ht, x, &node) == hashTable_OK)
+			!= ((x%4 == 0) || (x > UPPER_LIMIT)) ){
+			printf("Strange find result %ld after compact\n", x);
+		} else if( (x%4 == 0) && (node->value != (u64)x) ){
+			printf("Strange value %ld after compact\n", x);
+		}
+	}
+	// emptied slabs go back, only the one being filled stays
+	for (s64 x=1; x<=UPPER_LIMIT/4*5; x++){
+		hashTable_deleteIntKey(ht, x, 0);
+	}
+	hashTable_getFragmentation(ht, &frag);
+	printf("deleted all, %ld slab bytes mapped\n", frag.slabBytes);
+	if(frag.slabBytes > 2*1024*1024){
+		printf("Strange slabs left mapped\n");
+	}
+	hashTable_freeAll(&ht);
+	// slabs take the huge page and NUMA path of the bucket array
+	hashTable_initWithFlags(&ht,
+		hashTable_flagHugePages|hashTable_flagNumaInterleave);
+	for (s64 x=1; x<=LOG_LIMIT; x++){
+		hashTable_insertIntKey(ht, x, x);
+	}
+	hashTable_compact(ht, 0);
+	for (s64 x=1; x<=LOG_LIMIT; x++){
+		if( hashTable_findIntKey(ht, x, &node) || (node->value != (u64)x) ){
+			printf("Strange huge page slab value %ld\n", x);
+		}
+	}
+	hashTable_getFragmentation(ht, &frag);
+	if( frag.heapNodes || (frag.slabLiveBytes != frag.nodeBytes) ){
+		printf("Strange huge page slab fragmentation\n");
+	}
+	hashTable_freeAll(&ht);
+	// a blob growing past its slab node moves back to the heap
+	hashTable_initWithFlags(&ht, hashTable_flagBlobValues);
+	for (s64 x=1; x<=LOG_LIMIT; x++){
+		keyLen = hashTable_s64toString(x, keyBuffer);
+		hashTable_insertBlob(ht, keyBuffer, keyLen, "blob", 5);
+	}
+	hashTable_compact(ht, 0);
+	for (s64 x=1; x<=LOG_LIMIT; x+=2){
+		keyLen = hashTable_s64toString(x, keyBuffer);
+		sprintf(buff, "a longer blob for key %ld", x);
+		hashTable_insertBlob(ht, keyBuffer, keyLen, buff, strlen(buff)+1);
+	}
+	hashTable_compact(ht, 0);
+	for (s64 x=1; x<=LOG_LIMIT; x++){
+		keyLen = hashTable_s64toString(x, keyBuffer);
+		sprintf(buff, "a longer blob for key %ld", x);
+		if( hashTable_findBlob(ht, keyBuffer, keyLen, &blob, &blobLen)
+			|| strcmp((char*)blob, (x%2) ? buff : "blob") ){
+			printf("Strange blob %ld after compact\n", x);
+		}
+	}
+	hashTable_getFragmentation(ht, &frag);
+	if( frag.heapNodes || frag.splitLinks ){
+		printf("Strange blob table fragmentation\n");
+	}
+	hashTable_freeAll(&ht);
+	
+	printf("Generated table:\n");
+	{
+		static const char *keys[] = {"get", "set", "delete", "exists", "expire",
+			"ping", "echo", "info", "flush all", "client list"};
+		static const HtValue values[] = {1, 2, 3, 4, 0x40, 5, 6, 7, 100, 9};
+		for (u32 x=0; x<sizeof(keys)/sizeof(keys[0]); x++){
+			if( hashTable_findFrozen(&hashTableTestKeys, (u8*)keys[x],
+				strlen(keys[x]), &value) || (value != values[x]) ){
+				printf("Strange generated key %s\n", keys[x]);
+			}
+		}
+		if( (hashTable_findFrozen(&hashTableTestKeys, (u8*)"flush", 5, &value)
+			== hashTable_OK) || (hashTableTestKeys.count != 10) ){
+			printf("Strange generated table\n");
+		}
+		hashTable_init(&ht);
+		if(hashTableTestKeys.seed != hashTable_getSeed(ht)){
+			printf("Strange generated table seed %lx\n", hashTableTestKeys.seed);
+		}
+		hashTable_freeAll(&ht);
+		printf("%u keys, seed %lx\n", hashTableTestKeys.count,
+			hashTableTestKeys.seed);
+	}
 
 	return 0;
 }
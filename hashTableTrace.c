@@ -0,0 +1,329 @@
+/* hashTableTrace.c */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "hashTableTrace.h"
+
+typedef uint8_t  u8;
+typedef int8_t   s8;
+typedef uint32_t u32;
+typedef int32_t  s32;
+typedef uint64_t u64;
+typedef int64_t  s64;
+
+#define TRACE_MAGIC  "HTTRACE1"
+#define MAGIC_SIZE   (8)
+#define HEADER_SIZE  (MAGIC_SIZE+4+4+8)
+// op, keyLen, two varints of at most 10 bytes, key
+#define RECORD_MAX   (1+1+10+10+255)
+
+struct HashTableTrace {
+	HashTable        *ht;
+	hashTable_hookFn prevHook;   // hook found on the table, still called
+	void             *prevCtx;
+	u8               *buf;
+	u32              bufLen;
+	u32              flags;
+	u64              lastNanos;
+	s32              fd;
+	s32              error;      // first error seen, reported by stop
+};
+
+struct HashTableTraceReader {
+	FILE *file;
+	u64  nanos;
+	u32  flags;
+};
+
+/*******************************************************************************
+ * Section Internal Functions
+*******************************************************************************/
+
+static u64
+nowNanos(clockid_t clock)
+{
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return (u64)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+static u32
+putVarint(u8 *out, u64 value)
+{
+	u32 len = 0;
+	while(value >= 0x80){
+		out[len++] = (u8)value | 0x80;
+		value >>= 7;
+	}
+	out[len++] = (u8)value;
+	return len;
+}
+
+// 1 when the file ended or the varint is longer than 64 bits
+static s32
+getVarint(FILE *file, u64 *value)
+{
+	u64 result = 0;
+	u32 shift;
+	s32 byte;
+	for(shift = 0; shift < 64; shift += 7){
+		byte = getc(file);
+		if(byte == EOF){
+			return 1;
+		}
+		result |= (u64)(byte & 0x7F) << shift;
+		if((byte & 0x80) == 0){
+			*value = result;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// fnv-1a 64, only has to spread keys, the table rehashes them on replay
+static u64
+keyHash(u8 *key, u8 keyLen)
+{
+	u64 hash = 0xcbf29ce484222325;
+	u32 x;
+	for(x = 0; x < keyLen; x++){
+		hash = (hash ^ key[x]) * 0x100000001b3;
+	}
+	return hash;
+}
+
+static s32
+writeAll(s32 fd, u8 *data, u64 len)
+{
+	ssize_t written;
+	while(len){
+		written = write(fd, data, len);
+		if(written < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return hashTable_errorIo;
+		}
+		data += written;
+		len -= written;
+	}
+	return hashTable_OK;
+}
+
+static void
+flushTrace(HashTableTrace *trace)
+{
+	if( trace->bufLen && writeAll(trace->fd, trace->buf, trace->bufLen)
+		&& (trace->error == hashTable_OK) ){
+		trace->error = hashTable_errorIo;
+	}
+	trace->bufLen = 0;
+}
+
+/*******************************************************************************
+ * Section Hook
+*******************************************************************************/
+
+static void
+traceHook(void *ctx, u32 op, u8 *key, u8 keyLen, HtValue value)
+{
+	HashTableTrace *trace = ctx;
+	u8 *record;
+	u64 nanos = nowNanos(CLOCK_MONOTONIC), hash;
+	u32 len = 2;
+	if(trace->bufLen+RECORD_MAX > HASHTABLETRACE_BUFFER_SIZE){
+		flushTrace(trace);
+	}
+	record = trace->buf+trace->bufLen;
+	record[0] = op;
+	len += putVarint(record+len, nanos-trace->lastNanos);
+	len += putVarint(record+len, value);
+	if(trace->flags & hashTableTrace_flagHashKeys){
+		hash = keyHash(key, keyLen);
+		record[1] = sizeof(hash);
+		memcpy(record+len, &hash, sizeof(hash));
+		len += sizeof(hash);
+	} else {
+		record[1] = keyLen;
+		memcpy(record+len, key, keyLen);
+		len += keyLen;
+	}
+	trace->bufLen += len;
+	trace->lastNanos = nanos;
+	if(trace->prevHook){
+		trace->prevHook(trace->prevCtx, op, key, keyLen, value);
+	}
+}
+
+/*******************************************************************************
+ * Section Recording
+*******************************************************************************/
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableTrace_start(
+	HashTableTrace **trace_p,
+	HashTable      *ht,
+	const char     *path,
+	u32            flags)
+{
+	HashTableTrace *trace;
+	u8 header[HEADER_SIZE];
+	u32 zero = 0;
+	u64 started = nowNanos(CLOCK_REALTIME);
+	if(trace_p==0){
+		return hashTable_errorNullParam1;
+	}
+	if(ht==0){
+		return hashTable_errorNullParam2;
+	}
+	if(path==0){
+		return hashTable_errorNullParam3;
+	}
+	trace = HASHTABLE_MALLOC(sizeof(HashTableTrace));
+	if(trace==0){
+		return hashTable_errorMallocFailed;
+	}
+	trace->buf = HASHTABLE_MALLOC(HASHTABLETRACE_BUFFER_SIZE);
+	if(trace->buf==0){
+		HASHTABLE_FREE(trace);
+		return hashTable_errorMallocFailed;
+	}
+	trace->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	memcpy(header, TRACE_MAGIC, MAGIC_SIZE);
+	memcpy(header+MAGIC_SIZE, &flags, 4);
+	memcpy(header+MAGIC_SIZE+4, &zero, 4);
+	memcpy(header+MAGIC_SIZE+8, &started, 8);
+	if( (trace->fd < 0) || writeAll(trace->fd, header, HEADER_SIZE) ){
+		if(trace->fd >= 0){
+			close(trace->fd);
+		}
+		HASHTABLE_FREE(trace->buf);
+		HASHTABLE_FREE(trace);
+		return hashTable_errorIo;
+	}
+	trace->ht = ht;
+	trace->prevHook = ht->hook;
+	trace->prevCtx = ht->hookCtx;
+	trace->bufLen = 0;
+	trace->flags = flags;
+	trace->lastNanos = nowNanos(CLOCK_MONOTONIC);
+	trace->error = hashTable_OK;
+	hashTable_setHook(ht, traceHook, trace);
+	*trace_p = trace;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableTrace_stop(HashTableTrace **trace_p)
+{
+	HashTableTrace *trace;
+	s32 returnCode;
+	if( (trace_p==0) || (*trace_p==0) ){
+		return hashTable_errorNullParam1;
+	}
+	trace = *trace_p;
+	*trace_p = 0;
+	hashTable_setHook(trace->ht, trace->prevHook, trace->prevCtx);
+	flushTrace(trace);
+	returnCode = trace->error;
+	if( close(trace->fd) && (returnCode == hashTable_OK) ){
+		returnCode = hashTable_errorIo;
+	}
+	HASHTABLE_FREE(trace->buf);
+	HASHTABLE_FREE(trace);
+	return returnCode;
+}
+
+/*******************************************************************************
+ * Section Reading
+*******************************************************************************/
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableTrace_openReader(HashTableTraceReader **reader_p, const char *path)
+{
+	HashTableTraceReader *reader;
+	u8 header[HEADER_SIZE];
+	FILE *file;
+	if(reader_p==0){
+		return hashTable_errorNullParam1;
+	}
+	if(path==0){
+		return hashTable_errorNullParam2;
+	}
+	file = fopen(path, "rb");
+	if(file==0){
+		return hashTable_errorIo;
+	}
+	if( (fread(header, 1, HEADER_SIZE, file) != HEADER_SIZE)
+		|| memcmp(header, TRACE_MAGIC, MAGIC_SIZE) ){
+		fclose(file);
+		return hashTable_errorCorrupt;
+	}
+	reader = HASHTABLE_MALLOC(sizeof(HashTableTraceReader));
+	if(reader==0){
+		fclose(file);
+		return hashTable_errorMallocFailed;
+	}
+	reader->file = file;
+	reader->nanos = 0;
+	memcpy(&reader->flags, header+MAGIC_SIZE, 4);
+	*reader_p = reader;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+u32
+hashTableTrace_readerFlags(HashTableTraceReader *reader)
+{
+	return reader->flags;
+}
+
+HASHTABLE_STATIC_BUILD
+s32
+hashTableTrace_next(HashTableTraceReader *reader, HashTableTraceRecord *record)
+{
+	u64 delta, value;
+	s32 op, keyLen;
+	if(reader==0){
+		return hashTable_errorNullParam1;
+	}
+	if(record==0){
+		return hashTable_errorNullParam2;
+	}
+	op = getc(reader->file);
+	if(op == EOF){
+		return hashTable_nothingFound;
+	}
+	keyLen = getc(reader->file);
+	if( (keyLen == EOF) || (keyLen == 0)
+		|| getVarint(reader->file, &delta)
+		|| getVarint(reader->file, &value)
+		|| (fread(record->key, 1, keyLen, reader->file) != (u32)keyLen) ){
+		return hashTable_errorCorrupt;
+	}
+	reader->nanos += delta;
+	record->nanos = reader->nanos;
+	record->value = value;
+	record->op = op;
+	record->keyLen = keyLen;
+	return hashTable_OK;
+}
+
+HASHTABLE_STATIC_BUILD
+void
+hashTableTrace_closeReader(HashTableTraceReader **reader_p)
+{
+	if( (reader_p==0) || (*reader_p==0) ){
+		return;
+	}
+	fclose((*reader_p)->file);
+	HASHTABLE_FREE(*reader_p);
+	*reader_p = 0;
+}
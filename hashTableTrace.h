@@ -0,0 +1,79 @@
+/* hashTableTrace.h */
+
+#ifndef HASHTABLETRACE_HEADER
+#define HASHTABLETRACE_HEADER
+#include "hashTable.h"
+
+/*******************************************************************************
+ * Operation traces of a HashTable
+ *
+ * Recording attaches to the table hook and appends one record per insert,
+ * find and delete: op, key bytes or a 64 bit hash of them, value and the
+ * nanoseconds since the previous record. Deletes of missing keys change
+ * nothing and are not seen by the hook, so they are not recorded.
+ *
+ * File layout:
+ * header - "HTTRACE1", u32 flags, u32 0, u64 CLOCK_REALTIME nanos at start,
+ *          in host byte order like the hashTableLog files
+ * record - u8 op, u8 keyLen, varint delta nanos, varint value, keyLen bytes
+ * Varints are LEB128, 7 bits per byte low bits first.
+ *
+ * A hook already on the table keeps being called, so start recording after
+ * opening a hashTableLog and stop before closing it.
+*******************************************************************************/
+
+#ifndef HASHTABLETRACE_BUFFER_SIZE
+#define HASHTABLETRACE_BUFFER_SIZE (64*1024)
+#endif
+
+// flags for hashTableTrace_start
+enum {
+	// store an 8 byte hash in place of each key, keyLen is then 8
+	hashTableTrace_flagHashKeys = 1<<0
+};
+
+typedef struct HashTableTrace HashTableTrace;
+typedef struct HashTableTraceReader HashTableTraceReader;
+
+typedef struct HashTableTraceRecord {
+	uint64_t nanos;    // since the start of the trace
+	HtValue  value;
+	uint8_t  op;       // hashTable_op* value
+	uint8_t  keyLen;
+	uint8_t  key[255];
+} HashTableTraceRecord;
+
+// create or truncate path and record every operation on ht in to it
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableTrace_start(
+	HashTableTrace **trace_p, // address to write pointer to the new trace
+	HashTable      *ht,       // table to record
+	const char     *path,     // trace file
+	uint32_t       flags);    // hashTableTrace_flag* values
+
+// write out buffered records, put back the previous hook and free the trace
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableTrace_stop(HashTableTrace **trace_p);
+
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableTrace_openReader(HashTableTraceReader **reader_p, const char *path);
+
+// flags of the trace being read
+HASHTABLE_STATIC_BUILD
+uint32_t
+hashTableTrace_readerFlags(HashTableTraceReader *reader);
+
+// hashTable_OK with the next record, hashTable_nothingFound at the end,
+// hashTable_errorCorrupt if the file ends inside a record or is not a trace
+HASHTABLE_STATIC_BUILD
+int32_t
+hashTableTrace_next(HashTableTraceReader *reader, HashTableTraceRecord *record);
+
+HASHTABLE_STATIC_BUILD
+void
+hashTableTrace_closeReader(HashTableTraceReader **reader_p);
+
+#endif